@@ -10,7 +10,7 @@
 
 #include "aesd-circular-buffer.h"
 
-#define AESD_DEBUG 1  //Remove comment on this line to enable debug
+//#define AESD_DEBUG 1  //Remove comment on this line to enable debug (or build with DEBUG=y)
 
 #undef PDEBUG             /* undef it, just in case */
 #ifdef AESD_DEBUG
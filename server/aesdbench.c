@@ -0,0 +1,449 @@
+/***********************************************************************
+* @file  aesdbench.c
+* @version 1
+* @brief  Multi-connection load generator for aesdsocket
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*   1 -b also takes mmap and memory, checked like file and char
+*
+* Build with "make bench". Each of the -c connections runs on its own thread.
+* It sends -n lines of -s bytes, optionally paced to -r lines per second, and
+* every -k lines it sends an AESDCHAR_IOCSEEKTO:0,0 instead. Every line carries a
+* unique token, so its reply is recognised and checked against the backend:
+*
+*   file, mmap   Appends are never evicted, so each reply must end with the
+*                line just sent and must begin with the connection's previous
+*                reply.
+*   char, memory The driver, or its circular buffer in the server, keeps only
+*                the last few writes, so each reply must be whole lines and
+*                contain the line just sent.
+*
+* Pass -b the server's -S. A seek reply has no marker. It is taken as
+* complete once the socket stays idle for SEEK_IDLE_MS after a full line. The
+* file and mmap backends send nothing for a seek.
+*
+* Latency runs from when a line was due to be sent, not when it actually
+* was, so a stalled server is not hidden by the pacing (coordinated omission).
+* The default backend follows USE_AESD_CHAR_DEVICE, the same as the server.
+*
+* Usage: aesdbench [-H host] [-p port] [-c conns] [-n lines] [-s size]
+*                  [-r rate] [-k seek_every] [-b file|mmap|char|memory]
+*/
+
+#define _POSIX_C_SOURCE 200112L  // Enable POSIX features
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+
+#define SEEK_IDLE_MS 20     // Quiet period that ends a seek reply
+#define MIN_LINE_SIZE 24    // Room for the token and the newline
+
+struct bench_opts {
+    const char *host;
+    const char *port;
+    int conns;
+    long lines;             // Lines per connection
+    size_t size;            // Bytes per line including '\n'
+    double rate;            // Lines per second per connection, 0 = unpaced
+    long seek_every;        // Every Nth message is a seek, 0 = never
+    const char *backend;    // The server's -S
+    bool evicts;            // Replies follow the char driver's model
+};
+
+// The server's -S backends and which reply model each follows
+static const struct {
+    const char *name;
+    bool evicts;
+} backends[] = {
+    { "file", false },
+    { "mmap", false },
+    { "char", true },
+    { "memory", true },
+};
+
+struct bench_conn {
+    int id;
+    pthread_t thread;
+    int fd;
+    char *buf;              // Bytes of the reply being read
+    size_t len, cap;
+    char *prev;             // Previous append reply (file and mmap backends)
+    size_t prev_len, prev_cap;
+    uint64_t *lat;          // Append latencies, ns
+    size_t nlat;
+    uint64_t *seek_lat;
+    size_t nseek;
+    long seek_silent;       // Seeks answered with nothing
+    long errors;
+    uint64_t bytes_out, bytes_in;
+    bool failed;
+};
+
+static struct bench_opts opts = {
+    .host = "127.0.0.1",
+    .port = PORT,
+    .conns = 8,
+    .lines = 200,
+    .size = 64,
+    .rate = 0,
+    .seek_every = 0,
+    .backend = USE_AESD_CHAR_DEVICE ? "char" : "file",
+    .evicts = USE_AESD_CHAR_DEVICE,
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t when) {
+    struct timespec ts = { .tv_sec = when / 1000000000ULL, .tv_nsec = when % 1000000000ULL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) {
+    }
+}
+
+static int connect_to(const char *host, const char *port) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+    int rc = getaddrinfo(host, port, &hints, &res);
+    if (rc != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd == -1) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Append whatever the socket has to c->buf, waiting up to timeout_ms; 0 on timeout
+static int recv_some(struct bench_conn *c, int timeout_ms) {
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    int rc = poll(&pfd, 1, timeout_ms);
+    if (rc <= 0) {
+        return rc;
+    }
+    if (c->cap - c->len < 65536) {
+        size_t cap = c->cap ? c->cap * 2 : 131072;
+        char *buf = realloc(c->buf, cap);
+        if (!buf) return -1;
+        c->buf = buf;
+        c->cap = cap;
+    }
+    ssize_t n = recv(c->fd, c->buf + c->len, c->cap - c->len, 0);
+    if (n <= 0) {
+        return -1;  // The server never closes first, so EOF is an error too
+    }
+    c->len += n;
+    c->bytes_in += n;
+    return 1;
+}
+
+static bool ends_with(const char *buf, size_t len, const char *tail, size_t tail_len) {
+    return len >= tail_len && memcmp(buf + len - tail_len, tail, tail_len) == 0;
+}
+
+static bool contains(const char *buf, size_t len, const char *needle, size_t needle_len) {
+    for (const char *p = buf; len >= needle_len; ) {
+        const char *hit = memchr(p, needle[0], len - needle_len + 1);
+        if (!hit) return false;
+        if (memcmp(hit, needle, needle_len) == 0) return true;
+        len -= hit + 1 - p;
+        p = hit + 1;
+    }
+    return false;
+}
+
+// Read the reply to line, check it, and return when its last byte arrived
+static int await_append_reply(struct bench_conn *c, const char *line, size_t line_len,
+                              uint64_t *done) {
+    c->len = 0;
+    for (;;) {
+        bool complete = opts.evicts
+            ? (c->len > 0 && c->buf[c->len - 1] == '\n' && contains(c->buf, c->len, line, line_len))
+            : ends_with(c->buf, c->len, line, line_len);
+        if (complete) break;
+        if (recv_some(c, -1) != 1) {
+            fprintf(stderr, "conn %d: connection lost waiting for a reply\n", c->id);
+            return -1;
+        }
+    }
+    *done = now_ns();
+
+    if (!opts.evicts) {
+        // Append-only: the history seen last time must still be the prefix
+        if (c->len < c->prev_len || memcmp(c->buf, c->prev, c->prev_len) != 0) {
+            c->errors++;
+        }
+        if (c->len > c->prev_cap) {
+            char *prev = realloc(c->prev, c->cap);
+            if (!prev) return -1;
+            c->prev = prev;
+            c->prev_cap = c->cap;
+        }
+        memcpy(c->prev, c->buf, c->len);
+        c->prev_len = c->len;
+    }
+    return 0;
+}
+
+// Read a seek reply until the socket goes quiet after a whole line
+static int await_seek_reply(struct bench_conn *c, uint64_t *done) {
+    c->len = 0;
+    *done = 0;
+    for (;;) {
+        int rc = recv_some(c, SEEK_IDLE_MS);
+        if (rc == -1) {
+            fprintf(stderr, "conn %d: connection lost waiting for a seek reply\n", c->id);
+            return -1;
+        }
+        if (rc == 1) {
+            *done = now_ns();
+            continue;
+        }
+        if (c->len == 0 || c->buf[c->len - 1] == '\n') {
+            return 0;
+        }
+    }
+}
+
+static void *bench_thread(void *arg) {
+    struct bench_conn *c = arg;
+    char *line = malloc(opts.size);
+    c->lat = calloc(opts.lines, sizeof(*c->lat));
+    c->seek_lat = calloc(opts.lines, sizeof(*c->seek_lat));
+    if (!line || !c->lat || !c->seek_lat) {
+        c->failed = true;
+        free(line);
+        return NULL;
+    }
+    memset(line, 'a' + c->id % 26, opts.size);
+    line[opts.size - 1] = '\n';
+
+    uint64_t interval = opts.rate > 0 ? (uint64_t)(1e9 / opts.rate) : 0;
+    uint64_t due = now_ns();
+    for (long i = 0; i < opts.lines; i++) {
+        if (interval) {
+            due += interval;
+            sleep_until(due);
+        } else {
+            due = now_ns();
+        }
+
+        uint64_t done;
+        if (opts.seek_every && (i + 1) % opts.seek_every == 0) {
+            static const char seek[] = IOCTL_CMD_PREFIX "0,0\n";
+            if (send_all(c->fd, seek, sizeof(seek) - 1) == -1 ||
+                await_seek_reply(c, &done) == -1) {
+                c->failed = true;
+                break;
+            }
+            c->bytes_out += sizeof(seek) - 1;
+            if (done) {
+                c->seek_lat[c->nseek++] = done - due;
+            } else {
+                c->seek_silent++;
+            }
+            continue;
+        }
+
+        // Unique token at the front, filler after it
+        int n = snprintf(line, opts.size, "c%04d-%010ld-", c->id, i);
+        line[n] = 'a' + c->id % 26;
+        if (send_all(c->fd, line, opts.size) == -1 ||
+            await_append_reply(c, line, opts.size, &done) == -1) {
+            c->failed = true;
+            break;
+        }
+        c->bytes_out += opts.size;
+        c->lat[c->nlat++] = done - due;
+    }
+    free(line);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Print percentiles and a log2 histogram of samples, which get sorted
+static void report_latency(const char *what, uint64_t *samples, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    qsort(samples, n, sizeof(*samples), cmp_u64);
+    static const double points[] = { 0.50, 0.75, 0.90, 0.99, 0.999, 0.9999 };
+    printf("%s latency (us): min %.1f", what, samples[0] / 1e3);
+    for (size_t i = 0; i < sizeof(points) / sizeof(points[0]); i++) {
+        size_t idx = (size_t)(points[i] * n);
+        if (idx >= n) idx = n - 1;
+        printf("  p%g %.1f", points[i] * 100, samples[idx] / 1e3);
+    }
+    printf("  max %.1f\n", samples[n - 1] / 1e3);
+
+    size_t i = 0;
+    while (i < n) {
+        uint64_t upper = 1000;  // 1 us
+        while (upper <= samples[i]) upper *= 2;
+        size_t count = 0;
+        while (i < n && samples[i] < upper) {
+            count++;
+            i++;
+        }
+        printf("  < %10.1f us %8zu %6.2f%%\n", upper / 1e3, count, 100.0 * count / n);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-H host] [-p port] [-c conns] [-n lines] [-s size]"
+                    " [-r rate] [-k seek_every] [-b file|mmap|char|memory]\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:c:n:s:r:k:b:")) != -1) {
+        switch (opt) {
+        case 'H': opts.host = optarg; break;
+        case 'p': opts.port = optarg; break;
+        case 'c': opts.conns = atoi(optarg); break;
+        case 'n': opts.lines = atol(optarg); break;
+        case 's': opts.size = strtoul(optarg, NULL, 10); break;
+        case 'r': opts.rate = atof(optarg); break;
+        case 'k': opts.seek_every = atol(optarg); break;
+        case 'b': {
+            size_t i = 0;
+            while (i < sizeof(backends) / sizeof(backends[0]) && strcmp(optarg, backends[i].name) != 0) {
+                i++;
+            }
+            if (i == sizeof(backends) / sizeof(backends[0])) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            opts.backend = backends[i].name;
+            opts.evicts = backends[i].evicts;
+            break;
+        }
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (opts.conns <= 0 || opts.lines <= 0 || opts.size < MIN_LINE_SIZE ||
+        opts.rate < 0 || opts.seek_every < 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct bench_conn *conns = calloc(opts.conns, sizeof(*conns));
+    if (!conns) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < opts.conns; i++) {
+        conns[i].id = i;
+        conns[i].fd = connect_to(opts.host, opts.port);
+        if (conns[i].fd == -1) {
+            fprintf(stderr, "Failed to connect to %s:%s: %s\n", opts.host, opts.port, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < opts.conns; i++) {
+        if (pthread_create(&conns[i].thread, NULL, bench_thread, &conns[i]) != 0) {
+            fprintf(stderr, "Failed to create thread %d\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    size_t nlat = 0, nseek = 0;
+    long errors = 0, failed = 0, seek_silent = 0;
+    uint64_t bytes_out = 0, bytes_in = 0;
+    for (int i = 0; i < opts.conns; i++) {
+        pthread_join(conns[i].thread, NULL);
+        nlat += conns[i].nlat;
+        nseek += conns[i].nseek;
+        errors += conns[i].errors;
+        failed += conns[i].failed;
+        seek_silent += conns[i].seek_silent;
+        bytes_out += conns[i].bytes_out;
+        bytes_in += conns[i].bytes_in;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    uint64_t *all = malloc((nlat + nseek + 1) * sizeof(*all));
+    if (!all) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    size_t k = 0;
+    for (int i = 0; i < opts.conns; i++) {
+        memcpy(all + k, conns[i].lat, conns[i].nlat * sizeof(*all));
+        k += conns[i].nlat;
+    }
+
+    printf("%d connections, %zu byte lines, %s backend, %.2f s\n",
+           opts.conns, opts.size, opts.backend, elapsed);
+    printf("appends: %zu (%.0f/s)  seeks: %zu answered, %ld silent\n",
+           nlat, nlat / elapsed, nseek, seek_silent);
+    printf("sent %.2f MB/s  received %.2f MB/s\n",
+           bytes_out / elapsed / 1e6, bytes_in / elapsed / 1e6);
+    printf("verification: %ld bad replies, %ld failed connections\n", errors, failed);
+    report_latency("append", all, nlat);
+
+    k = 0;
+    for (int i = 0; i < opts.conns; i++) {
+        memcpy(all + k, conns[i].seek_lat, conns[i].nseek * sizeof(*all));
+        k += conns[i].nseek;
+    }
+    report_latency("seek", all, nseek);
+
+    for (int i = 0; i < opts.conns; i++) {
+        close(conns[i].fd);
+        free(conns[i].buf);
+        free(conns[i].prev);
+        free(conns[i].lat);
+        free(conns[i].seek_lat);
+    }
+    free(all);
+    free(conns);
+    return (errors || failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
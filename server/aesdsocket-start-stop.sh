@@ -21,10 +21,23 @@ stop() {
     rm -f $PIDFILE
 }
 
+upgrade() {
+    # The running server execs the binary now at /usr/bin/aesdsocket and
+    # hands it the listening socket, so no connection is refused meanwhile
+    echo "Upgrading aesdsocket..."
+    start-stop-daemon -K -s USR2 -n aesdsocket
+    if [ $? -eq 0 ]; then
+        echo "aesdsocket upgrade requested."
+    else
+        echo "Failed to upgrade aesdsocket."
+    fi
+}
+
 case "$1" in
     start) start ;;
     stop) stop ;;
-    *) echo "Usage: $0 {start|stop}" ; exit 1 ;;
+    upgrade) upgrade ;;
+    *) echo "Usage: $0 {start|stop|upgrade}" ; exit 1 ;;
 esac
 
 exit 0
@@ -1,6 +1,6 @@
 /***********************************************************************
 * @file  aesdsocket.c
-* @version 2
+* @version 28
 * @brief  Implementation of socket
 *
 * @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
@@ -13,6 +13,32 @@
 *   0 Initial release.
 *	1 A6 P1 Changes for handling multiple simultaneous connections
 *	2 A8 AESD char device support and previous assignment corrections
+*	3 Optional edge-triggered epoll reactor mode (-m epoll)
+*	4 Optional io_uring execution backend (-m uring)
+*	5 Pre-spawned worker pool (-m pool) and slab backed connection registry
+*	6 Zero-copy history echo with sendfile()/splice()
+*	7 Echo the history outside file_mutex from a snapshot
+*	8 Optional in-memory history mirror (-M) with writev() replies
+*	9 Unbounded streaming line framer (-L caps the line length)
+*	10 Appends go through a group commit writer thread
+*	11 Per-connection data file read fd, no open()/close() per message
+*	12 SO_REUSEPORT sharded reactors (-m shard) and configurable backlog (-b)
+*	13 Latency histograms and counters, reported by the AESD_STATS command
+*	14 Asynchronous rate limited logging on request paths
+*	15 timerfd timestamps in the main loops, cached formatting, -T interval
+*	16 Length-prefixed binary framing, negotiated by the first byte
+*	17 AESD_DELTA sessions echo only new history, AESD_FULL resyncs
+*	18 AESD_SUBSCRIBE turns a connection into a push-only tail of new appends
+*	19 SIGUSR2 hot upgrade hands the listeners and history to a new binary
+*	20 -S mmap keeps DATA_FILE in a mapped log and replies straight from it
+*	21 -R retention over -G sized segments; replies cover the retained window
+*	22 -S picks a storage backend at runtime: file, mmap, char or memory
+*	23 Pool workers receive and snapshot into per-worker buffer arenas (-A)
+*	24 -F deficit round robin quotas per source address for the reactors
+*	25 -U AF_UNIX listener; AESD_MEMFD appends a memfd passed with SCM_RIGHTS
+*	26 -u batched UDP ingest with recvmmsg(), one append per batch, no reply
+*	27 Appends go through the sink's submit hook when it has one, so reactors can reply later
+*	28 -R is refused with -S mmap, which cannot reclaim its address space
 *
 *Ref:
 * 1. Lecture Videos
@@ -21,7 +47,7 @@
 * 4. A8 instructions
 */
 
-#define _POSIX_C_SOURCE 200112L  // Enable POSIX features
+#define _GNU_SOURCE  // Enable POSIX features
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,6 +57,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <signal.h>
 #include <syslog.h>
 #include <fcntl.h>
@@ -40,55 +67,67 @@
 #include <pthread.h>
 #include <time.h>  // Needed for time functions
 #include "queue.h"
-#include <sys/ioctl.h>
-#include "../aesd-char-driver/aesd_ioctl.h"
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include "aesdsocket.h"
 
-#define PORT "9000"    // Port to listen on
-#define BACKLOG 10     // Max pending connections
-#define BUF_SIZE 1024  // Buffer size for receiving data
-#define TIMESTAMP_INTERVAL 10  // Interval for timestamp updates
-
-/* Build switch for AESD char device */
-#define USE_AESD_CHAR_DEVICE 1
-
-#define IOCTL_CMD_PREFIX "AESDCHAR_IOCSEEKTO:"
-
-#if (USE_AESD_CHAR_DEVICE == 1)
-    #define DATA_FILE "/dev/aesdchar"
-#else
-    #define DATA_FILE "/var/tmp/aesdsocketdata"
-#endif
+struct server_config config = {
+    .mode = SERVER_MODE_THREAD,
+    .io_threads = 0,
+    .backlog = BACKLOG,
+    .history_mirror = false,
+    .max_line_len = MAX_LINE_DEFAULT,
+    .timestamp_interval = { .tv_sec = TIMESTAMP_INTERVAL },
+    .arena_buffers = ARENA_BUFFERS_DEFAULT,
+    .arena_buf_size = ARENA_BUF_SIZE_DEFAULT,
+};
 
 volatile sig_atomic_t stop_flag = 0;
 int sockfd = -1;  // Listening socket file descriptor
+int wake_fd = -1; // Wakes the accept, reactor or io_uring loop on shutdown
+static int stamp_fd = -1;  // Timestamp timer of the thread and pool accept loops
 
-// Mutex to protect writes to DATA_FILE
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-// Define the thread node using SLIST macros from queue.h
-typedef struct thread_node {
-    pthread_t thread;                  // Thread handle
-    int client_fd;                     // Client socket file descriptor
-    SLIST_ENTRY(thread_node) entries;  // Linked list entry
-} thread_node_t;
+// How often a waiting subscriber thread checks for a closed client or shutdown
+#define SUBSCRIBE_POLL_MS 200
 
-// Define and initialize the head of our singly linked list
-SLIST_HEAD(thread_list_head_s, thread_node);
-struct thread_list_head_s thread_list_head = SLIST_HEAD_INITIALIZER(thread_list_head);
-
-// Timer thread ID
-pthread_t timer_thread_id;
+// Held by the writer thread while it commits a batch to the -S backend
+pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 // Function to handle cleanup on exit
 void cleanup() {
+    // A successor shares the listener, so it must be closed but not shut down
+    bool handing_off = handoff_pending();
+    // Its last batch is committed before the writer stops
+    udp_close();
     if (sockfd != -1) {
-        shutdown(sockfd, SHUT_RDWR);  // Gracefully shutdown socket before closing
+        if (!handing_off) {
+            shutdown(sockfd, SHUT_RDWR);  // Gracefully shutdown socket before closing
+        }
         close(sockfd);
         sockfd = -1;
     }
-    #if (USE_AESD_CHAR_DEVICE == 0)
-        remove(DATA_FILE);
-    #endif
+    local_close(handing_off);
+    if (wake_fd != -1) {
+        close(wake_fd);
+        wake_fd = -1;
+    }
+    if (stamp_fd != -1) {
+        close(stamp_fd);
+        stamp_fd = -1;
+    }
+    writer_stop();
+    if (handing_off) {
+        handoff_finish();
+    } else if (config.storage && config.storage->discard) {
+        config.storage->discard();
+    }
+    segment_destroy();
+    history_destroy();
+    broadcast_destroy();
+    handoff_stop();
+    log_stop();
     closelog();
 }
 
@@ -97,6 +136,13 @@ void signal_handler(int signal) {
         stop_flag = 1;
         syslog(LOG_INFO, "Caught signal, exiting");
         shutdown(sockfd, SHUT_RDWR); // Force unblock accept
+        if (wake_fd != -1) {
+            uint64_t one = 1;
+            ssize_t rc = write(wake_fd, &one, sizeof(one)); // Force unblock epoll_wait
+            (void)rc;
+        }
+    } else if (signal == SIGUSR2) {
+        handoff_request();
     }
 }
 
@@ -139,7 +185,7 @@ bool create_daemon() {
 }
 
 // Function to get a socket and bind it to the specified port
-int get_listener_socket(const char *port) {
+int get_listener_socket(const char *port, bool reuseport) {
     struct addrinfo hints, *res;
     int sockfd;
     int yes = 1;
@@ -171,6 +217,14 @@ int get_listener_socket(const char *port) {
         return -1;
     }
 
+    // Sharded listeners all bind the same port and the kernel spreads connections
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof yes) == -1) {
+        syslog(LOG_ERR, "Failed to set SO_REUSEPORT: %s", strerror(errno));
+        close(sockfd);
+        freeaddrinfo(res);
+        return -1;
+    }
+
     // Bind the socket to the port
     if (bind(sockfd, res->ai_addr, res->ai_addrlen) == -1) {
         syslog(LOG_ERR, "Failed to bind socket: %s", strerror(errno));
@@ -183,158 +237,862 @@ int get_listener_socket(const char *port) {
     return sockfd;
 }
 
-// Thread function that handles an individual client connection
-void *connection_handler(void *arg) {
-	thread_node_t *node = (thread_node_t *)arg;
-	int client_fd = node->client_fd;
-	char buf[BUF_SIZE];
-	char message_buffer[BUF_SIZE];  // Buffer to store complete messages
+// Send reply bytes on a blocking client socket
+static int send_reply(void *ctx, const char *buf, size_t len) {
+    int client_fd = *(int *)ctx;
+    size_t total_sent = 0;
+    while (total_sent < len) {
+        ssize_t sent_now = send(client_fd, buf + total_sent, len - total_sent, 0);
+        if (sent_now == -1) {
+            if (errno == EINTR) continue;
+            aesd_log_ratelimited(LOG_ERR, "Send failed: %s", strerror(errno));
+            return -1;
+        }
+        total_sent += sent_now;
+        stats_add(STAT_BYTES_OUT, sent_now);
+    }
+    return 0;
+}
+
+// Release the resources a sink picked up while replying
+void reply_sink_release(struct reply_sink *sink) {
+    if (sink->data_fd != -1) {
+        close(sink->data_fd);
+        sink->data_fd = -1;
+    }
+    arena_free(sink->arena, sink->snapshot);
+    sink->snapshot = NULL;
+    sink->snapshot_cap = 0;
+    passed_fds_release(sink);
+    if (sink->subscribed) {
+        broadcast_unsubscribe();
+        sink->subscribed = false;
+    }
+}
+
+// A reply has been copied out of the snapshot; hand an arena buffer back
+static void snapshot_done(struct reply_sink *sink) {
+    if (arena_owns(sink->arena, sink->snapshot)) {
+        arena_free(sink->arena, sink->snapshot);
+        sink->snapshot = NULL;
+        sink->snapshot_cap = 0;
+    }
+}
+
+// Bytes of the retained window ending at end, given the window starts at base
+static size_t window_len(off_t base, off_t end) {
+    return end > base ? (size_t)(end - base) : 0;
+}
+
+// How much of a len byte history a delta session has not been sent yet
+static size_t delta_len(const struct reply_sink *sink, off_t end, size_t len) {
+    if (!sink->delta || sink->cursor > end || (uint64_t)(end - sink->cursor) > len) {
+        return len;  // Resync, or older bytes were evicted before they were sent
+    }
+    return end - sink->cursor;
+}
+
+/*
+ * Echo the history. history_end is where the client's own line ended, or -1
+ * when there was no append. A delta session gets only the bytes past its
+ * cursor unless full is set; either way the cursor moves to what was sent.
+ */
+static void reply_history(struct reply_sink *sink, off_t history_end, bool full) {
+    uint64_t start = stats_now();
+
+    if (config.history_mirror) {
+        // The writer mirrored the append; reply from memory, no read of the backend
+        struct history_snapshot snap;
+        if (history_snapshot(&snap) == 0) {
+            size_t send_len = full ? snap.total_len
+                                   : delta_len(sink, snap.appended, snap.total_len);
+            history_send(&snap, snap.total_len - send_len, sink);
+            sink->cursor = snap.appended;
+            history_release(&snap);
+            stats_record(STAT_SEND, start);
+        }
+        return;
+    }
+
+    const struct storage_ops *storage = config.storage;
+    if (!storage->evicts) {
+        if (history_end == -1) {
+            history_end = storage->length(sink);
+            if (history_end == -1) {
+                return;
+            }
+        }
+        // Under -R only the retained window is sent, and it cannot be freed meanwhile
+        off_t base = segment_pin();
+        size_t len = window_len(base, history_end);
+        size_t send_len = full ? len : delta_len(sink, history_end, len);
+        storage->send(sink, history_end - send_len, history_end);
+        segment_unpin(base);
+        sink->cursor = history_end;
+        stats_record(STAT_SEND, start);
+        return;
+    }
+
+    // Offsets shift as entries are evicted, so history_end is of no use here.
+    // Hold off the writer so the snapshot is not torn by a commit.
+    stats_lock(&file_mutex);
+    ssize_t history_len = storage->snapshot(sink, 0, SIZE_MAX);
+    off_t appended = writer_history_end();
+    pthread_mutex_unlock(&file_mutex);
+    if (history_len > 0) {
+        size_t send_len = full ? (size_t)history_len : delta_len(sink, appended, history_len);
+        sink->write(sink->ctx, sink->snapshot + history_len - send_len, send_len);
+    }
+    snapshot_done(sink);
+    sink->cursor = appended;
+    stats_record(STAT_SEND, start);
+}
+
+static void reply_range(int op, off_t start, uint64_t count, struct reply_sink *sink);
+
+// Seek like AESDCHAR_IOCSEEKTO; returns the history position, or -1
+static off_t seek_history(struct reply_sink *sink, uint32_t cmd, uint32_t offset) {
+    uint64_t start = stats_now();
+    // The memory backend's entries are guarded by file_mutex
+    stats_lock(&file_mutex);
+    off_t pos = config.storage->seek(sink, cmd, offset);
+    int err = errno;
+    pthread_mutex_unlock(&file_mutex);
+    stats_record(STAT_SEEK, start);
+    if (pos == -1) {
+        aesd_log_ratelimited(LOG_ERR, "ioctl failed: %s", strerror(err));
+    }
+    return pos;
+}
+
+static void send_frame(struct reply_sink *sink, int op, const char *payload, size_t len);
+static void send_frame_error(struct reply_sink *sink, const char *msg);
+
+void append_reply(int op, int status, off_t end, struct reply_sink *sink) {
+    if (op == AESD_OP_LINE) {
+        // A failed text append gets no reply, as before binary framing
+        if (status == 0) {
+            reply_history(sink, end, false);
+        }
+        return;
+    }
+    if (status != 0) {
+        send_frame_error(sink, op == AESD_OP_MEMFD ? "memfd append failed" : "append failed");
+        return;
+    }
+    uint8_t ack[VARINT_MAX];
+    size_t ack_len = varint_put(ack, config.storage->evicts ? 0 : end);
+    send_frame(sink, op, (const char *)ack, ack_len);
+}
+
+// Commit data through the writer, then reply. Event loops take the append
+// over through sink->submit and reply once the writer has called back.
+static void append_then_reply(int op, const char *data, size_t len, bool mapped,
+                              struct reply_sink *sink) {
+    if (sink->submit) {
+        if (sink->submit(sink->ctx, op, data, len, mapped) == -1) {
+            if (mapped) {
+                memfd_unmap(data, len);
+            }
+            append_reply(op, -1, 0, sink);
+        }
+        return;
+    }
+    off_t end = 0;
+    uint64_t start = stats_now();
+    int status = writer_append(data, len, &end);
+    if (status == 0) {
+        stats_record(STAT_APPEND, start);
+    }
+    if (mapped) {
+        memfd_unmap(data, len);
+    }
+    append_reply(op, status, end, sink);
+}
+
+// Handle one complete message: either an ioctl seek command or a line to append
+void process_message(const char *msg, size_t len, struct reply_sink *sink) {
+    stats_add(STAT_MESSAGES, 1);
+
+    // Reserved stats command, answered from memory and never appended
+    if (len == strlen(STATS_CMD) && memcmp(msg, STATS_CMD, len) == 0) {
+        char report[STATS_REPORT_SIZE];
+        size_t report_len = stats_report(report, sizeof(report));
+        sink->write(sink->ctx, report, report_len);
+        return;
+    }
+
+    // Session commands: both resend the whole history, AESD_DELTA also
+    // switches later replies to what was appended since the previous one
+    if (len == strlen(DELTA_CMD) && memcmp(msg, DELTA_CMD, len) == 0) {
+        sink->delta = true;
+        reply_history(sink, -1, true);
+        return;
+    }
+    if (len == strlen(FULL_CMD) && memcmp(msg, FULL_CMD, len) == 0) {
+        reply_history(sink, -1, true);
+        return;
+    }
+
+    // From here on the connection's server pushes appends from the broadcast ring
+    if (len == strlen(SUBSCRIBE_CMD) && memcmp(msg, SUBSCRIBE_CMD, len) == 0) {
+        broadcast_subscribe(&sink->tail);
+        sink->subscribed = true;
+        return;
+    }
+
+    // A local producer's batch of lines, passed as a sealed memfd
+    if (len == strlen(MEMFD_CMD) && memcmp(msg, MEMFD_CMD, len) == 0) {
+        size_t batch_len;
+        const char *batch = memfd_map(sink, &batch_len);
+        if (batch) {
+            append_then_reply(AESD_OP_LINE, batch, batch_len, true, sink);
+        }
+        return;
+    }
+
+    // Check for IOCTL command
+    if (len >= strlen(IOCTL_CMD_PREFIX) &&
+        memcmp(msg, IOCTL_CMD_PREFIX, strlen(IOCTL_CMD_PREFIX)) == 0) {
+        // msg is not NUL terminated; the arguments are short, copy them out
+        char args[64];
+        size_t args_len = len - strlen(IOCTL_CMD_PREFIX);
+        if (args_len >= sizeof(args)) args_len = sizeof(args) - 1;
+        memcpy(args, msg + strlen(IOCTL_CMD_PREFIX), args_len);
+        args[args_len] = '\0';
+
+        unsigned int x, y;
+        if (sscanf(args, "%u,%u", &x, &y) == 2) {
+            // The seek moves this connection's position only
+            off_t pos = seek_history(sink, x, y);
+            if (pos != -1) {
+                // Send response after seeking
+                reply_range(AESD_OP_LINE, pos, 0, sink);
+            }
+        } else {
+            aesd_log_ratelimited(LOG_ERR, "Malformed AESDCHAR_IOCSEEKTO command");
+        }
+        return;
+    }
+
+    // The writer thread commits the line together with whatever else is queued;
+    // the reply is streamed afterwards so a slow reader cannot stall writers
+    append_then_reply(AESD_OP_LINE, msg, len, false, sink);
+}
+
+// Reply to a binary request with one frame
+static void send_frame(struct reply_sink *sink, int op, const char *payload, size_t len) {
+    char frame[FRAME_HEADER_MAX + 64];
+    size_t header = frame_header_put((uint8_t *)frame, op, len);
+    if (len <= sizeof(frame) - header) {
+        // Acks and errors go out in a single write
+        memcpy(frame + header, payload, len);
+        sink->write(sink->ctx, frame, header + len);
+        return;
+    }
+    if (sink->write(sink->ctx, frame, header) == 0) {
+        sink->write(sink->ctx, payload, len);
+    }
+}
+
+static void send_frame_error(struct reply_sink *sink, const char *msg) {
+    send_frame(sink, AESD_OP_ERROR, msg, strlen(msg));
+}
+
+// Parse the two varint arguments of a SEEK or READ payload
+static bool frame_args(const char *payload, size_t len, uint64_t *first, uint64_t *second) {
+    const uint8_t *p = (const uint8_t *)payload;
+    int n = varint_get(p, len, first);
+    if (n <= 0) {
+        return false;
+    }
+    int m = varint_get(p + n, len - n, second);
+    return m > 0 && (size_t)(n + m) == len;
+}
+
+/*
+ * Reply with count bytes of the history from start, or the rest if count is 0.
+ * For op AESD_OP_LINE the bytes go out as they are; otherwise they are one
+ * frame of that op, and like requests carry at most max_line_len bytes.
+ */
+static void reply_range(int op, off_t start, uint64_t count, struct reply_sink *sink) {
+    uint64_t send_start = stats_now();
+    bool framed = op != AESD_OP_LINE;
+    if (count == 0) {
+        count = framed ? config.max_line_len : UINT64_MAX;
+    } else if (framed && count > config.max_line_len) {
+        count = config.max_line_len;
+    }
+
+    const struct storage_ops *storage = config.storage;
+    if (!storage->evicts) {
+        off_t end = storage->length(sink);
+        if (end == -1) {
+            if (framed) {
+                send_frame_error(sink, "read failed");
+            }
+            return;
+        }
+        // Offsets before the retained window read from its start
+        off_t base = segment_pin();
+        if (start < base) start = base;
+        if (start > end) start = end;
+        if (count < (uint64_t)(end - start)) end = start + count;
+
+        uint8_t header[FRAME_HEADER_MAX];
+        size_t header_len = framed ? frame_header_put(header, op, end - start) : 0;
+        if (!framed || sink->write(sink->ctx, (const char *)header, header_len) == 0) {
+            storage->send(sink, start, end);
+        }
+        segment_unpin(base);
+    } else {
+        stats_lock(&file_mutex);
+        ssize_t len = storage->snapshot(sink, start, count > SIZE_MAX ? SIZE_MAX : (size_t)count);
+        pthread_mutex_unlock(&file_mutex);
+        if (len == -1) {
+            if (framed) {
+                send_frame_error(sink, "read failed");
+            }
+            snapshot_done(sink);
+            return;
+        }
+        if (framed) {
+            send_frame(sink, op, sink->snapshot, len);
+        } else if (len > 0) {
+            sink->write(sink->ctx, sink->snapshot, len);
+        }
+        snapshot_done(sink);
+    }
+    stats_record(STAT_SEND, send_start);
+}
+
+// Handle one binary frame; every request gets exactly one reply frame
+void process_frame(int op, const char *payload, size_t len, struct reply_sink *sink) {
+    switch (op) {
+    case AESD_OP_HELLO: {
+        char magic = (char)AESD_BIN_MAGIC;
+        sink->write(sink->ctx, &magic, 1);
+        return;
+    }
+    case AESD_OP_APPEND: {
+        if (len == 0) {
+            send_frame_error(sink, "empty append");
+            return;
+        }
+        append_then_reply(AESD_OP_APPEND, payload, len, false, sink);
+        return;
+    }
+    case AESD_OP_MEMFD: {
+        size_t batch_len;
+        const char *batch = len == 0 ? memfd_map(sink, &batch_len) : NULL;
+        if (!batch) {
+            append_reply(AESD_OP_MEMFD, -1, 0, sink);
+            return;
+        }
+        append_then_reply(AESD_OP_MEMFD, batch, batch_len, true, sink);
+        return;
+    }
+    case AESD_OP_SEEK: {
+        uint64_t cmd, offset;
+        if (!frame_args(payload, len, &cmd, &offset) || cmd > UINT32_MAX || offset > UINT32_MAX) {
+            send_frame_error(sink, "malformed seek");
+            return;
+        }
+        off_t pos = seek_history(sink, cmd, offset);
+        if (pos == -1) {
+            send_frame_error(sink, "seek failed");
+            return;
+        }
+        reply_range(AESD_OP_SEEK, pos, 0, sink);
+        return;
+    }
+    case AESD_OP_READ: {
+        uint64_t offset, count;
+        if (!frame_args(payload, len, &offset, &count) || offset > INT64_MAX) {
+            send_frame_error(sink, "malformed read");
+            return;
+        }
+        reply_range(AESD_OP_READ, offset, count, sink);
+        return;
+    }
+    case AESD_OP_STATS: {
+        char report[STATS_REPORT_SIZE];
+        send_frame(sink, AESD_OP_STATS, report, stats_report(report, sizeof(report)));
+        return;
+    }
+    case AESD_OP_ERROR:
+        send_frame_error(sink, "frame dropped");
+        return;
+    default:
+        send_frame_error(sink, "unknown opcode");
+        return;
+    }
+}
+
+void process_request(int op, const char *msg, size_t len, struct reply_sink *sink) {
+    if (sink->subscribed) {
+        return;  // Push-only once subscribed
+    }
+    if (op == AESD_OP_LINE) {
+        process_message(msg, len, sink);
+        return;
+    }
+    if (op != AESD_OP_HELLO && op != AESD_OP_ERROR) {
+        stats_add(STAT_MESSAGES, 1);
+    }
+    process_frame(op, msg, len, sink);
+}
+
+// message_fn for blocking connections: process and reply inline
+static void handle_client_message(void *ctx, int op, const char *msg, size_t len) {
+    process_request(op, msg, len, ctx);
+}
+
+// Push every append to a subscribed client until it disconnects or the server stops
+static void serve_subscriber(int client_fd, struct reply_sink *sink) {
+	char discard[BUF_SIZE];
+	while (!stop_flag) {
+		// A slow client blocks only this thread; the ring skips it ahead if it lags
+		if (broadcast_send(client_fd, &sink->tail, 0) == -1) {
+			break;
+		}
+		broadcast_wait(&sink->tail, SUBSCRIBE_POLL_MS);
+
+		// Input is ignored from here on, but a close ends the subscription
+		ssize_t n = recv(client_fd, discard, sizeof(discard), MSG_DONTWAIT);
+		if (n == 0) {
+			aesd_log(LOG_INFO, "Subscriber disconnected");
+			break;
+		}
+		if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			break;
+		}
+	}
+}
+
+// Serve one client on a blocking socket until it disconnects; the caller's
+// registry_remove() closes it
+void serve_client(int client_fd, struct buf_arena *arena) {
+	char stack_buf[BUF_SIZE];
+	struct line_framer framer;
+	struct reply_sink sink = {
+		.write = send_reply,
+		.ctx = &client_fd,
+		.sock_fd = client_fd,
+		.data_fd = -1,
+		.arena = arena,
+		.snapshot = NULL,
+		.snapshot_cap = 0,
+	};
 	ssize_t bytes_received;
-	size_t message_length = 0;
-
-	while ((bytes_received = recv(client_fd, buf, BUF_SIZE, 0)) > 0) {
-		for (ssize_t i = 0; i < bytes_received; i++) {
-			if (message_length >= BUF_SIZE - 1) {
-			syslog(LOG_ERR, "Message too long, discarding");
-			message_length = 0;
-			continue;
-			}
-
-			message_buffer[message_length++] = buf[i];
-			// Message complete, write to file
-			if (buf[i] == '\n') {
-				// Make sure the newline is included in the message length
-				message_buffer[message_length] = '\0';  // Properly null-terminate the message
-
-				// Check for IOCTL command
-				if (strncmp(message_buffer, IOCTL_CMD_PREFIX, strlen(IOCTL_CMD_PREFIX)) == 0) {
-					unsigned int x, y;
-					if (sscanf(message_buffer + strlen(IOCTL_CMD_PREFIX), "%u,%u", &x, &y) == 2) {
-						struct aesd_seekto seekto = {
-							.write_cmd = x,
-							.write_cmd_offset = y
-						};
-
-						int fd = open(DATA_FILE, O_RDWR);
-						if (fd >= 0) {
-							if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
-								syslog(LOG_ERR, "ioctl failed: %s", strerror(errno));
-							} else {
-								// Send response after seeking
-								char send_buf[BUF_SIZE];
-								ssize_t bytes_read;
-								while ((bytes_read = read(fd, send_buf, BUF_SIZE)) > 0) {
-								    ssize_t total_sent = 0;
-								    while (total_sent < bytes_read) {
-									ssize_t sent_now = send(client_fd, send_buf + total_sent, bytes_read - total_sent, 0);
-									if (sent_now == -1) {
-									    syslog(LOG_ERR, "Send failed: %s", strerror(errno));
-									    break;
-									}
-									total_sent += sent_now;
-								    }
-								}
-							}
-							close(fd);
-						} else {
-							syslog(LOG_ERR, "Failed to open data file for ioctl: %s", strerror(errno));
-						}
-					} else {
-						syslog(LOG_ERR, "Malformed AESDCHAR_IOCSEEKTO command");
-					}
-				} else {
-					pthread_mutex_lock(&file_mutex);
-					int fd = open(DATA_FILE, O_RDWR | O_APPEND);
-					if (fd >= 0) {
-						// message_length includes the '\n'
-						if (write(fd, message_buffer, message_length) == -1) {
-							syslog(LOG_ERR, "Write failed: %s", strerror(errno));
-						}
-
-						if (lseek(fd, 0, SEEK_SET) == -1) {
-							syslog(LOG_ERR, "lseek failed: %s", strerror(errno));
-						}
-
-						char send_buf[BUF_SIZE];
-						ssize_t bytes_read;
-						while ((bytes_read = read(fd, send_buf, BUF_SIZE)) > 0) {
-						    ssize_t total_sent = 0;
-						    while (total_sent < bytes_read) {
-							ssize_t sent_now = send(client_fd, send_buf + total_sent, bytes_read - total_sent, 0);
-							if (sent_now == -1) {
-							    syslog(LOG_ERR, "Send failed: %s", strerror(errno));
-							    break;
-							}
-							total_sent += sent_now;
-						    }
-						}
-						close(fd);
-					} else {
-						syslog(LOG_ERR, "Failed to open data file: %s", strerror(errno));
-					}
-					pthread_mutex_unlock(&file_mutex);
-				}
-
-				message_length = 0;  // Reset buffer for next message
-			}
+
+	// A pool worker receives into an arena buffer, as large as -A makes it
+	size_t buf_size = BUF_SIZE;
+	char *buf = arena ? arena_alloc(arena, BUF_SIZE, &buf_size) : NULL;
+	if (!buf) {
+		buf = stack_buf;
+		buf_size = BUF_SIZE;
+	}
+
+	framer_init(&framer, config.max_line_len, arena);
+	stats_conn_open();
+	for (;;) {
+		uint64_t recv_start = stats_now();
+		bytes_received = recv_client(client_fd, buf, buf_size, &sink);
+		stats_record(STAT_RECV, recv_start);
+		if (bytes_received <= 0) {
+			break;
 		}
+		stats_add(STAT_BYTES_IN, bytes_received);
+		framer_feed(&framer, buf, bytes_received, handle_client_message, &sink);
+		if (sink.subscribed) {
+			serve_subscriber(client_fd, &sink);
+			break;
+		}
+	}
+	stats_conn_close();
+
+	reply_sink_release(&sink);
+	framer_free(&framer);
+	if (buf != stack_buf) {
+		arena_free(arena, buf);
 	}
 
 	if (bytes_received == 0) {
-		syslog(LOG_INFO, "Client disconnected");
+		aesd_log(LOG_INFO, "Client disconnected");
 	} else if (bytes_received < 0) {
-		syslog(LOG_ERR, "recv() failed: %s", strerror(errno));
+		aesd_log_ratelimited(LOG_ERR, "recv() failed: %s", strerror(errno));
 	}
+}
 
-	close(client_fd);
+// Thread function that handles an individual client connection
+void *connection_handler(void *arg) {
+	struct conn_slot *slot = (struct conn_slot *)arg;
+	serve_client(slot->client_fd, NULL);
+	registry_remove(slot);  // O(1), closes the socket and frees the slot
 	return NULL;
 }
 
-// Timer thread function that appends a timestamp every 10 seconds.
-void *timer_thread(void *arg) {
-    (void)arg;
-    struct timespec next_wakeup;
-    clock_gettime(CLOCK_MONOTONIC, &next_wakeup);
+// Render the current time as an RFC 2822 style "timestamp:" line
+size_t format_timestamp(char *buf, size_t size) {
+    // Everything but the seconds changes at most once a minute, so only the
+    // seconds are rendered per call. Zone offsets are whole minutes, so local
+    // minutes turn over together with time()'s.
+    static time_t cached_minute = -1;
+    static char head[64];
+    static char zone[16];
+    static size_t head_len, zone_len;
+
+    time_t now = time(NULL);
+    if (now / 60 != cached_minute) {
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        head_len = strftime(head, sizeof(head), "timestamp:%a, %d %b %Y %H:%M:", &tm_info);
+        zone_len = strftime(zone, sizeof(zone), " %z\n", &tm_info);
+        cached_minute = now / 60;
+    }
+
+    size_t len = head_len + 2 + zone_len;
+    if (head_len == 0 || zone_len == 0 || len >= size) {
+        return 0;
+    }
+    unsigned sec = now % 60;
+    memcpy(buf, head, head_len);
+    buf[head_len] = '0' + sec / 10;
+    buf[head_len + 1] = '0' + sec % 10;
+    memcpy(buf + head_len + 2, zone, zone_len);
+    buf[len] = '\0';
+    return len;
+}
+
+// Append a timestamp line through the writer thread
+void write_timestamp(void) {
+    char time_string[128];
+    size_t len = format_timestamp(time_string, sizeof(time_string));
+    if (len == 0) {
+        return;
+    }
+    aesd_log(LOG_DEBUG, "Writing timestamp: %s", time_string);
+    writer_append(time_string, len, NULL);
+}
+
+int timestamp_timer_create(void) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1) {
+        syslog(LOG_ERR, "timerfd_create failed: %s", strerror(errno));
+        return -1;
+    }
+    struct itimerspec its = {
+        .it_interval = config.timestamp_interval,
+        .it_value = config.timestamp_interval,
+    };
+    if (timerfd_settime(fd, 0, &its, NULL) == -1) {
+        syslog(LOG_ERR, "timerfd_settime failed: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
 
+int accept_client(int timer_fd, uint64_t *ready) {
+    // wake_fd stops the loop without shutting down the listener, for upgrades
+    struct pollfd fds[4] = {
+        { .fd = sockfd, .events = POLLIN },
+        { .fd = timer_fd, .events = POLLIN },
+        { .fd = wake_fd, .events = POLLIN },
+        { .fd = local_fd, .events = POLLIN },  // -1 without -U, which poll() skips
+    };
     while (!stop_flag) {
-        next_wakeup.tv_sec += TIMESTAMP_INTERVAL;
+        if (poll(fds, 4, -1) == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "poll failed: %s", strerror(errno));
+            return -1;
+        }
+        if (fds[1].revents & POLLIN) {
+            // A late wakeup reports several expirations; one line covers them
+            uint64_t expirations;
+            if (read(timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+                write_timestamp();
+            }
+        }
+        int listen_fd = fds[0].revents ? sockfd : fds[3].revents ? local_fd : -1;
+        if (listen_fd == -1 || stop_flag) {
+            continue;
+        }
+        *ready = stats_now();
+        int new_fd = accept(listen_fd, NULL, NULL);
+        if (new_fd != -1) {
+            return new_fd;
+        }
+        if (errno != EINTR && !stop_flag) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+        }
+    }
+    return -1;
+}
 
-        int rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_wakeup, NULL);
-        if (rc != 0 && rc != EINTR) {
-            syslog(LOG_ERR, "clock_nanosleep error: %s", strerror(rc));
-            break;
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-d] [-m thread|epoll|uring|pool|shard] [-t threads] [-b backlog] [-M] [-L max_line_bytes] [-T interval_seconds]\n"
+                    "          [-S file|mmap|char|memory]\n"
+                    "          [-R bytes=N[KMG],entries=N,age=seconds] [-G segment_bytes] [-A buffers[,bytes]]\n"
+                    "          [-F quantum[,addr[/bits]=quantum...]] [-U socket_path] [-u]\n", prog);
+    fprintf(stderr, "Send SIGUSR2 to hand over to the binary now installed at the same path\n");
+}
+
+// Parse a byte count with an optional K, M or G suffix
+static bool parse_size(const char *arg, uint64_t *out) {
+    char *end;
+    unsigned long long value = strtoull(arg, &end, 10);
+    switch (*end) {
+    case 'G': value <<= 10; // fall through
+    case 'M': value <<= 10; // fall through
+    case 'K': value <<= 10; end++; break;
+    }
+    *out = value;
+    return end != arg && *end == '\0';
+}
+
+// Parse -R, a comma separated list of bytes=, entries= and age= limits
+static bool parse_retention(char *arg, struct retention_config *retention) {
+    for (char *save, *item = strtok_r(arg, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        uint64_t value;
+        if (strncmp(item, "bytes=", 6) == 0 && parse_size(item + 6, &value) && value > 0) {
+            retention->bytes = value;
+        } else if (strncmp(item, "entries=", 8) == 0 && parse_size(item + 8, &value) && value > 0) {
+            retention->entries = value;
+        } else if (strncmp(item, "age=", 4) == 0 && parse_size(item + 4, &value) && value > 0) {
+            retention->age = value;
+        } else {
+            return false;
         }
+    }
+    return true;
+}
 
-        if (stop_flag) {
-            break;
+// Parse -A, the buffer count of each worker arena and optionally their size
+static bool parse_arena(char *arg) {
+    char *size = strchr(arg, ',');
+    if (size) {
+        *size++ = '\0';
+    }
+    char *end;
+    unsigned long long count = strtoull(arg, &end, 10);
+    if (end == arg || *end != '\0' || count > 65536) {
+        return false;
+    }
+    config.arena_buffers = count;
+    uint64_t bytes;
+    if (size) {
+        if (!parse_size(size, &bytes) || bytes < BUF_SIZE || bytes > 64 * 1024 * 1024) {
+            return false;
         }
+        config.arena_buf_size = bytes;
+    }
+    return true;
+}
 
-        #if (USE_AESD_CHAR_DEVICE == 0)  
-        time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
-        char time_string[128];
-        strftime(time_string, sizeof(time_string), "timestamp:%a, %d %b %Y %H:%M:%S %z\n", tm_info);
+// A -F quantum: bytes per round, 0 for unthrottled
+static bool parse_quantum(const char *arg, uint64_t *quantum) {
+    return parse_size(arg, quantum) && *quantum <= (1ULL << 30);
+}
 
-        pthread_mutex_lock(&file_mutex);
-        FILE *fp = fopen(DATA_FILE, "a+");
-        if (fp) {
-            syslog(LOG_DEBUG, "Writing timestamp to file: %s", time_string);
-            fputs(time_string, fp);
-            fflush(fp);
-            fclose(fp);
-        } else {
-            syslog(LOG_ERR, "Failed to open data file for timestamp: %s", strerror(errno));
+// Parse -F, the default quantum and then addr[/bits]=quantum rules, comma separated
+static bool parse_fair(char *arg) {
+    char *save;
+    char *item = strtok_r(arg, ",", &save);
+    if (!item || !parse_quantum(item, &config.fair.quantum)) {
+        return false;
+    }
+    while ((item = strtok_r(NULL, ",", &save))) {
+        if (config.fair.rule_count == FAIR_MAX_RULES) {
+            return false;
         }
-        pthread_mutex_unlock(&file_mutex);
-        #endif
+        struct fair_rule *rule = &config.fair.rules[config.fair.rule_count];
+        char *quantum = strchr(item, '=');
+        if (!quantum) {
+            return false;
+        }
+        *quantum++ = '\0';
+        unsigned long prefix = 32;
+        char *bits = strchr(item, '/');
+        if (bits) {
+            *bits++ = '\0';
+            char *end;
+            prefix = strtoul(bits, &end, 10);
+            if (end == bits || *end != '\0' || prefix > 32) {
+                return false;
+            }
+        }
+        struct in_addr addr;
+        if (inet_pton(AF_INET, item, &addr) != 1 || !parse_quantum(quantum, &rule->quantum)) {
+            return false;
+        }
+        rule->prefix = prefix;
+        rule->mask = prefix ? htonl(~0U << (32 - prefix)) : 0;
+        rule->addr = addr.s_addr & rule->mask;
+        config.fair.rule_count++;
     }
-    return NULL;
+    return true;
 }
 
 int main(int argc, char *argv[]) {
     bool is_daemon = false;
-    if (argc == 2 && strcmp(argv[1], "-d") == 0) {
-        is_daemon = true;
+    int handoff_fd = -1;  // Set by -H when exec'd by a predecessor for an upgrade
+    uint64_t segment_size = SEGMENT_SIZE_DEFAULT;
+    int opt;
+    config.storage = storage_find(USE_AESD_CHAR_DEVICE ? "char" : "file");
+    while ((opt = getopt(argc, argv, "dm:t:ML:b:T:H:S:R:G:A:F:U:u")) != -1) {
+        switch (opt) {
+        case 'd':
+            is_daemon = true;
+            break;
+        case 'm':
+            if (strcmp(optarg, "thread") == 0) {
+                config.mode = SERVER_MODE_THREAD;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                config.mode = SERVER_MODE_EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+                config.mode = SERVER_MODE_URING;
+            } else if (strcmp(optarg, "pool") == 0) {
+                config.mode = SERVER_MODE_POOL;
+            } else if (strcmp(optarg, "shard") == 0) {
+                config.mode = SERVER_MODE_SHARD;
+            } else {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L': {
+            char *end;
+            unsigned long long max_line = strtoull(optarg, &end, 10);
+            if (*end != '\0' || max_line == 0) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            config.max_line_len = max_line;
+            break;
+        }
+        case 'b':
+            config.backlog = atoi(optarg);
+            if (config.backlog <= 0) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'M':
+            config.history_mirror = true;
+            break;
+        case 'T': {
+            // Fractions of a second are allowed, down to a millisecond
+            char *end;
+            double seconds = strtod(optarg, &end);
+            if (*end != '\0' || !(seconds >= 0.001 && seconds <= 86400)) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            config.timestamp_interval.tv_sec = (time_t)seconds;
+            config.timestamp_interval.tv_nsec = (long)((seconds - (time_t)seconds) * 1e9);
+            break;
+        }
+        case 'H':
+            handoff_fd = atoi(optarg);
+            break;
+        case 'R':
+            if (!parse_retention(optarg, &config.retention)) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'G':
+            if (!parse_size(optarg, &segment_size) || segment_size == 0) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'A':
+            if (!parse_arena(optarg)) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'F':
+            if (!parse_fair(optarg)) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'U':
+            // Absolute, so the daemon can still remove it after chdir("/")
+            if (optarg[0] != '/' || strlen(optarg) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            config.local_path = optarg;
+            break;
+        case 'u':
+            config.udp_ingest = true;
+            break;
+        case 'S':
+            config.storage = storage_find(optarg);
+            if (!config.storage) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            config.io_threads = atoi(optarg);
+            if (config.io_threads < 0) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Segments are whole pages, so punching one frees all of its blocks
+    if (config.retention.bytes || config.retention.entries || config.retention.age) {
+        if (config.storage->evicts) {
+            fprintf(stderr, "-S %s already caps its history, -R needs -S file\n",
+                    config.storage->name);
+            exit(EXIT_FAILURE);
+        }
+        // Punched segments free disk blocks but not the mapped log's offsets
+        if (!config.storage->retains) {
+            fprintf(stderr, "-S %s runs out of address space however much -R drops, "
+                    "-R needs -S file\n", config.storage->name);
+            exit(EXIT_FAILURE);
+        }
+        long page = sysconf(_SC_PAGESIZE);
+        config.retention.segment_size = (segment_size + page - 1) / page * page;
+    }
+
+    // io_uring appends and reads back through its own linked chains
+    if (!config.storage->uring && config.mode == SERVER_MODE_URING) {
+        fprintf(stderr, "-S %s needs a mode with the writer thread, not -m uring\n",
+                config.storage->name);
+        exit(EXIT_FAILURE);
+    }
+
+    // The ring's multishot recv cannot take passed descriptors
+    if (config.local_path && config.mode == SERVER_MODE_URING) {
+        fprintf(stderr, "-U needs -m thread, pool, epoll or shard\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Datagrams are committed through the writer thread, which io_uring lacks
+    if (config.udp_ingest && config.mode == SERVER_MODE_URING) {
+        fprintf(stderr, "-u needs -m thread, pool, epoll or shard\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Only the reactors interleave clients; the other modes give each its own
+    // thread, or serve one message at a time per connection
+    if ((config.fair.quantum || config.fair.rule_count) &&
+        config.mode != SERVER_MODE_EPOLL && config.mode != SERVER_MODE_SHARD) {
+        fprintf(stderr, "-F needs -m epoll or -m shard\n");
+        exit(EXIT_FAILURE);
     }
 
     // Open syslog
@@ -348,21 +1106,64 @@ int main(int argc, char *argv[]) {
     sa.sa_flags = 0;
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
 
-    #if (USE_AESD_CHAR_DEVICE == 0)
-        FILE *fp = fopen(DATA_FILE, "w");
-        if (fp) fclose(fp);
-    #endif
+    // A client that disconnects mid-reply must fail send(), not kill the server
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
 
-    // Get a listening socket
-    if ((sockfd = get_listener_socket(PORT)) == -1) {
+    if (handoff_fd != -1) {
+        // The predecessor already detached, and its history is still live.
+        // Take over its listeners and history instead of starting afresh.
+        is_daemon = false;
+        if (handoff_adopt(handoff_fd) == -1) {
+            close(handoff_fd);
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        if (config.storage->reset() == -1) {
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+
+        // Seed the mirror with what the backend already holds
+        if (config.history_mirror && history_init() == -1) {
+            syslog(LOG_ERR, "Failed to load history mirror: %s", strerror(errno));
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+
+        // Get a listening socket
+        // In shard mode this is the first of the reactors' SO_REUSEPORT listeners
+        if ((sockfd = get_listener_socket(PORT, config.mode == SERVER_MODE_SHARD)) == -1) {
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+
+        // Listen for incoming connections
+        if (listen(sockfd, config.backlog) == -1) {
+            syslog(LOG_ERR, "Failed to listen on socket");
+            cleanup();
+            exit(EXIT_FAILURE);
+        }
+    }
+    handoff_add_listener(sockfd);
+
+    // Local producers connect here, or to the predecessor's socket we took over
+    if (config.local_path && (local_fd = local_listener(config.local_path)) == -1) {
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+
+    // Bound before daemonizing, so a port clash is reported to the caller
+    if (config.udp_ingest && udp_open() == -1) {
         cleanup();
         exit(EXIT_FAILURE);
     }
 
-    // Listen for incoming connections
-    if (listen(sockfd, BACKLOG) == -1) {
-        syslog(LOG_ERR, "Failed to listen on socket");
+    // Track segments before anything is appended, or take the predecessor's table
+    if (config.retention.segment_size && segment_init() == -1) {
         cleanup();
         exit(EXIT_FAILURE);
     }
@@ -373,60 +1174,100 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
-    // Create the timer thread in the parent process.
-    if (pthread_create(&timer_thread_id, NULL, timer_thread, NULL) != 0) {
-        syslog(LOG_ERR, "Failed to create timer thread: %s", strerror(errno));
+    // Every mode but io_uring appends through the group commit writer,
+    // started after the fork so the thread lives in the daemon
+    if (config.mode != SERVER_MODE_URING && writer_start() == -1) {
         cleanup();
         exit(EXIT_FAILURE);
     }
 
+    // Request paths log through per-thread rings from here on
+    if (log_start() == -1) {
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+
+    if ((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        syslog(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+
+    // Fire-and-forget producers are served beside whichever mode runs below
+    if (config.udp_ingest && udp_start() == -1) {
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+
+    // Upgrades are best effort; the server runs fine without them
+    handoff_init(argc, argv);
+    if (handoff_fd != -1) {
+        handoff_ready(handoff_fd);  // The predecessor may exit now
+    }
+
+    if (config.mode == SERVER_MODE_EPOLL || config.mode == SERVER_MODE_SHARD ||
+        config.mode == SERVER_MODE_URING) {
+        // The event loops multiplex clients and the timestamp timer themselves
+        int rc = (config.mode == SERVER_MODE_URING) ? run_uring() : run_reactor();
+        cleanup();
+        return rc == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    // The accept loop below (or the pool's) services the timestamp timer
+    if ((stamp_fd = timestamp_timer_create()) == -1) {
+        cleanup();
+        exit(EXIT_FAILURE);
+    }
+
+    if (config.mode == SERVER_MODE_POOL) {
+        int rc = run_pool(stamp_fd);
+        close(sockfd);
+        sockfd = -1;
+        cleanup();
+        return rc == 0 ? 0 : EXIT_FAILURE;
+    }
+
+    // Client threads are detached and create no joinable state per accept
+    pthread_attr_t client_attr;
+    pthread_attr_init(&client_attr);
+    pthread_attr_setdetachstate(&client_attr, PTHREAD_CREATE_DETACHED);
+
     // Main server loop: accept connections until stop_flag is set
     while (!stop_flag) {
-        struct sockaddr_in client_addr;
-        socklen_t addr_len = sizeof(client_addr);
-        int new_fd = accept(sockfd, (struct sockaddr *)&client_addr, &addr_len);
-
+        uint64_t accept_start;
+        int new_fd = accept_client(stamp_fd, &accept_start);
         if (new_fd == -1) {
-            if (errno == EINTR) continue;
-            syslog(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
-            continue;
+            break;
         }
 
-        // Allocate a new thread node and insert it into our SLIST.
-        thread_node_t *node = malloc(sizeof(thread_node_t));
-        if (!node) {
-            syslog(LOG_ERR, "Failed to allocate memory for thread node");
+        // Register the client; the slot is recycled when the thread exits
+        struct conn_slot *slot = registry_add(new_fd);
+        if (!slot) {
             close(new_fd);
             continue;
         }
-        node->client_fd = new_fd;
-        SLIST_INSERT_HEAD(&thread_list_head, node, entries);
 
-        if (pthread_create(&node->thread, NULL, connection_handler, node) != 0) {
-            syslog(LOG_ERR, "Failed to create client thread: %s", strerror(errno));
-            close(new_fd);
-            free(node);
+        if (pthread_create(&slot->thread, &client_attr, connection_handler, slot) != 0) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to create client thread: %s", strerror(errno));
+            registry_remove(slot);  // Closes new_fd
             continue;
         }
-
-        pthread_detach(node->thread); // Ensure thread cleans up after execution
+        stats_record(STAT_ACCEPT, accept_start);
     }
+    pthread_attr_destroy(&client_attr);
 
     // Stop accepting new connections.
     close(sockfd);
+    sockfd = -1;
 
-    // Join timer thread before cleanup
-    if (pthread_join(timer_thread_id, NULL) != 0) {
-        syslog(LOG_ERR, "Failed to join timer thread: %s", strerror(errno));
-    }
-
-    // Join all client threads before exit
-    thread_node_t *node, *temp_node;
-    SLIST_FOREACH_SAFE(node, &thread_list_head, entries, temp_node) {
-        pthread_join(node->thread, NULL);  // Ensure all threads complete
-        SLIST_REMOVE(&thread_list_head, node, thread_node, entries);
-        free(node);
+    // Wait for all client threads before exit. Before a hot upgrade they
+    // first get a moment to finish the request they are on.
+    if (handoff_pending()) {
+        registry_drain(HANDOFF_DRAIN_MS);
     }
+    registry_shutdown_all();
+    registry_wait_empty();
+    registry_destroy();
     // Cleanup and exit
     cleanup();
     return 0;
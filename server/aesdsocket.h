@@ -0,0 +1,568 @@
+/***********************************************************************
+* @file  aesdsocket.h
+* @version 5
+* @brief  Shared definitions for the aesdsocket server modules
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release, split out of aesdsocket.c for the epoll reactor.
+*   1 struct storage_ops; USE_AESD_CHAR_DEVICE only picks the default -S backend
+*   2 Per-worker buffer arenas (-A)
+*   3 Deficit round robin quotas per source address (-F); the framer can yield
+*   4 AF_UNIX listener (-U) and sealed memfd appends passed with SCM_RIGHTS
+*   5 Batched UDP ingest (-u) and writer_append_batch()
+*/
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <time.h>
+#include "queue.h"
+
+#define PORT "9000"    // Port to listen on
+#define BACKLOG 10     // Max pending connections unless -b is given
+#define BUF_SIZE 1024  // Buffer size for receiving data
+#define TIMESTAMP_INTERVAL 10  // Seconds between timestamp lines unless -T is given
+#define ZERO_COPY_CHUNK 65536  // Bytes moved per sendfile() call
+#define MAX_LINE_DEFAULT (1024 * 1024)  // Longest accepted line unless -L is given
+#define SEGMENT_SIZE_DEFAULT (1024 * 1024)  // Retention segment size unless -G is given
+#define ARENA_BUFFERS_DEFAULT 32            // Buffers per worker arena unless -A is given
+#define ARENA_BUF_SIZE_DEFAULT (16 * 1024)  // Bytes per arena buffer unless -A is given
+#define FAIR_MAX_RULES 32                   // Per-address -F quotas
+#define PASSED_FDS_MAX 8                    // Descriptors a connection may hold for AESD_MEMFD
+#define MEMFD_APPEND_MAX (256L * 1024 * 1024)  // Largest memfd appended in one go
+
+/* Build switch for AESD char device: picks the default -S backend */
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE 1
+#endif
+
+#define IOCTL_CMD_PREFIX "AESDCHAR_IOCSEEKTO:"
+#define STATS_CMD "AESD_STATS\n"  // Reserved line answered with stats_report()
+#define DELTA_CMD "AESD_DELTA\n"  // Reserved line: full history now, only new bytes after
+#define FULL_CMD "AESD_FULL\n"    // Reserved line: resend the whole history
+#define SUBSCRIBE_CMD "AESD_SUBSCRIBE\n"  // Reserved line: push new appends, ignore input
+#define MEMFD_CMD "AESD_MEMFD\n"  // Reserved line: append the oldest passed memfd
+#define STATS_REPORT_SIZE 4096
+
+/*
+ * Binary framing. A client opts in by sending AESD_BIN_MAGIC as its very
+ * first byte, which the server echoes back. From then on every request and
+ * reply is a frame: the payload length as an unsigned LEB128 varint, one
+ * opcode byte, then the payload. Replies come back in request order, so a
+ * client may pipeline any number of frames. Payloads may hold any bytes,
+ * including '\n', and are limited by -L like lines are.
+ *
+ *   APPEND  payload: bytes to append   reply: varint history length after it
+ *                                      (0 on the char and memory backends)
+ *   SEEK    varint write_cmd, varint write_cmd_offset
+ *                                      reply: history from there to the end
+ *   READ    varint offset, varint length (0 for the rest)
+ *                                      reply: those bytes of the history
+ *   STATS   no payload                 reply: the AESD_STATS report
+ *   MEMFD   no payload                 reply: as APPEND, for the oldest memfd
+ *                                      passed on this -U connection
+ *
+ * SEEK and READ replies also stop at the -L limit; the client reads on from
+ * where the reply ended. Under -R, offsets before the retained window read
+ * from its start. A request that fails is answered with an
+ * AESD_OP_ERROR frame holding a short message instead.
+ */
+#define AESD_BIN_MAGIC 0xAE
+#define VARINT_MAX 10        // Bytes in the longest 64-bit varint
+#define FRAME_HEADER_MAX (VARINT_MAX + 1)
+
+typedef enum {
+    AESD_OP_LINE = 0,        // Text protocol line; never sent on the wire
+    AESD_OP_APPEND = 1,
+    AESD_OP_SEEK = 2,
+    AESD_OP_READ = 3,
+    AESD_OP_STATS = 4,
+    AESD_OP_MEMFD = 5,
+    AESD_OP_HELLO = 0x7e,    // Magic byte seen; never sent on the wire
+    AESD_OP_ERROR = 0x7f,    // Reply only; the framer also uses it for a dropped frame
+} aesd_op_t;
+
+#define DATA_FILE "/var/tmp/aesdsocketdata"  // file and mmap backends
+#define CHAR_DEVICE "/dev/aesdchar"          // char backend
+
+// How client connections are serviced
+typedef enum {
+    SERVER_MODE_THREAD = 0,  // One blocking thread per connection (default)
+    SERVER_MODE_EPOLL,       // Edge-triggered epoll reactor on a fixed thread set
+    SERVER_MODE_URING,       // Single threaded io_uring ring with linked SQEs
+    SERVER_MODE_POOL,        // Fixed pool of blocking workers fed by a queue
+    SERVER_MODE_SHARD,       // epoll reactors pinned per core, one SO_REUSEPORT listener each
+} server_mode_t;
+
+// -R limits on the retained DATA_FILE window; 0 means no limit of that kind
+struct retention_config {
+    uint64_t bytes;
+    uint64_t entries;        // Appends, as the char driver counts its history
+    time_t age;              // Seconds since a segment was last written
+    size_t segment_size;     // Unit of retention; 0 when no limit is set
+};
+
+// A -F quota for clients whose IPv4 address matches addr under mask
+struct fair_rule {
+    uint32_t addr;           // Network byte order, like sin_addr
+    uint32_t mask;
+    unsigned prefix;         // Bits in mask; the longest matching rule wins
+    uint64_t quantum;
+};
+
+// -F deficit round robin quotas; a quantum of 0 leaves a client unthrottled
+struct fair_config {
+    uint64_t quantum;        // Bytes per round for clients no rule matches
+    size_t rule_count;
+    struct fair_rule rules[FAIR_MAX_RULES];
+};
+
+// Runtime options parsed from the command line
+struct server_config {
+    server_mode_t mode;
+    const struct storage_ops *storage;  // -S backend
+    int io_threads;          // Reactor/pool threads, 0 picks a default from the CPU count
+    int backlog;             // listen() backlog for every listening socket
+    bool history_mirror;     // Serve replies from the in-memory history mirror
+    size_t max_line_len;     // Lines longer than this are discarded
+    struct timespec timestamp_interval;  // Period of the timestamp timer
+    struct retention_config retention;
+    size_t arena_buffers;    // Buffers in each worker's arena, 0 for none
+    size_t arena_buf_size;
+    struct fair_config fair;
+    const char *local_path;  // -U socket path, NULL for TCP only
+    bool udp_ingest;         // -u: append datagrams arriving on UDP PORT
+};
+
+extern struct server_config config;
+extern volatile sig_atomic_t stop_flag;
+extern int sockfd;        // Listening socket file descriptor
+extern int wake_fd;       // eventfd signalled on shutdown, -1 if unused
+extern pthread_mutex_t file_mutex;
+
+// Fixed-size I/O buffers owned by one worker thread, see arena.c
+struct buf_arena {
+    char *base;              // count buffers of size bytes, cache line aligned
+    size_t size;
+    size_t count;
+    void *free_list;         // Free buffers, linked through their first word
+};
+
+// count buffers of buf_size bytes each; count 0 leaves everything to the heap
+int arena_init(struct buf_arena *arena, size_t count, size_t buf_size);
+void arena_destroy(struct buf_arena *arena);
+bool arena_owns(const struct buf_arena *arena, const void *buf);
+// At least len bytes, *cap set to what the buffer holds: an arena buffer
+// when len fits and one is free, otherwise malloc(). arena may be NULL.
+void *arena_alloc(struct buf_arena *arena, size_t len, size_t *cap);
+// Back to the arena it came from, or free() it
+void arena_free(struct buf_arena *arena, void *buf);
+
+// A subscriber's place in the broadcast ring, see broadcast.c
+struct broadcast_cursor {
+    uint64_t pos;        // Bytes published before the next one to send
+    bool partial;        // The last byte sent did not end a line
+    bool resync;         // Skipped into a line: drop bytes through its '\n'
+};
+
+/*
+ * Sink for reply bytes produced while handling a message. Returns 0 when all
+ * of buf was accepted, -1 when the connection can take no more.
+ */
+typedef int (*reply_fn)(void *ctx, const char *buf, size_t len);
+
+// Where the reply to a message goes
+struct reply_sink {
+    reply_fn write;      // Copies reply bytes to the client
+    void *ctx;
+    int sock_fd;         // Blocking client socket usable for zero-copy, or -1
+    int data_fd;         // Connection's read fd on the backend's path, opened on first use
+    struct buf_arena *arena;  // Where snapshot is drawn from, NULL for the heap
+    char *snapshot;      // History copied out under file_mutex (evicting backends)
+    size_t snapshot_cap;
+    bool delta;          // AESD_DELTA session: echo only what is new to the client
+    off_t cursor;        // History position the client has been sent up to
+    bool subscribed;     // AESD_SUBSCRIBE seen: later requests are ignored
+    struct broadcast_cursor tail;  // Broadcast position of a subscribed client
+    int passed_fds[PASSED_FDS_MAX];  // Received with SCM_RIGHTS, oldest first
+    unsigned passed_count;
+    // Set by event loops, which must not wait for the writer: takes the append
+    // over and calls append_reply() once it is committed. data may be
+    // transient unless mapped, in which case it is a memfd_map() mapping to
+    // release afterwards. Returns -1 if it could not be queued. NULL appends
+    // inline with writer_append().
+    int (*submit)(void *ctx, int op, const char *data, size_t len, bool mapped);
+};
+
+// Release the data fd, snapshot buffer and passed descriptors a sink picked up
+void reply_sink_release(struct reply_sink *sink);
+
+// AF_UNIX listener and memfd appends, see local.c
+extern int local_fd;      // -U listening socket, -1 without -U
+int local_listener(const char *path);
+void local_close(bool handing_off);
+// recv() that keeps descriptors passed with SCM_RIGHTS in the sink
+ssize_t recv_client(int fd, char *buf, size_t len, struct reply_sink *sink);
+void passed_fds_release(struct reply_sink *sink);
+// Map the oldest passed memfd for one append and close it; NULL if it is
+// missing or unfit. The caller unmaps it once the writer is done with it.
+const char *memfd_map(struct reply_sink *sink, size_t *len);
+void memfd_unmap(const char *data, size_t len);
+
+// Batched UDP ingest, see udp.c. udp_open() binds (or takes over) the
+// socket; udp_start() runs the ingest thread once the writer and wake_fd are up.
+int udp_open(void);
+int udp_start(void);
+void udp_close(void);            // Stop the thread and close our descriptor
+
+/*
+ * Called by the framer with each complete message. For a text line op is
+ * AESD_OP_LINE and msg includes the '\n'; for a binary frame op is the frame's
+ * opcode and msg its payload. msg is not NUL terminated and may point into
+ * the caller's receive buffer.
+ */
+typedef void (*message_fn)(void *ctx, int op, const char *msg, size_t len);
+
+// Framing state kept per connection, see framer.c
+struct line_framer {
+    char *buf;           // Partial line or frame carried over between receives
+    size_t len;
+    size_t cap;
+    size_t max_line;
+    bool discarding;     // Dropping the rest of an over-long line
+    bool negotiated;     // First byte seen, protocol decided
+    bool binary;         // Client opted into binary framing
+    size_t skip;         // Bytes of a dropped frame still to come
+    bool yield;          // Set by on_message to stop framer_feed() after it
+    struct buf_arena *arena;  // Where buf is drawn from, NULL for the heap
+};
+
+void framer_init(struct line_framer *framer, size_t max_line, struct buf_arena *arena);
+void framer_free(struct line_framer *framer);
+
+// Split received bytes into messages and hand each complete one to on_message.
+// Returns the bytes consumed: all of len, unless on_message set framer->yield,
+// in which case framing stops right after that message and the rest is the
+// caller's to feed again later.
+size_t framer_feed(struct line_framer *framer, const char *buf, size_t len,
+                   message_fn on_message, void *ctx);
+
+// Varint coding for binary frames. varint_get() returns the bytes consumed,
+// 0 if buf ends first, or -1 if the value runs past VARINT_MAX bytes.
+size_t varint_put(uint8_t *buf, uint64_t value);
+int varint_get(const uint8_t *buf, size_t len, uint64_t *value);
+
+// Write a frame header for a len byte payload; returns its size
+size_t frame_header_put(uint8_t *buf, int op, uint64_t len);
+
+// Handle one newline terminated message (append or ioctl seek) and reply
+void process_message(const char *msg, size_t len, struct reply_sink *sink);
+
+// Handle one binary frame and reply with a frame. Appends go through the
+// writer thread, so io_uring mode handles AESD_OP_APPEND itself.
+void process_frame(int op, const char *payload, size_t len, struct reply_sink *sink);
+
+// Count a message and pass it to process_message() or process_frame()
+void process_request(int op, const char *msg, size_t len, struct reply_sink *sink);
+
+// Reply to an append of op (AESD_OP_LINE for a text line or AESD_MEMFD,
+// AESD_OP_APPEND or AESD_OP_MEMFD) that ended with status, at history end
+void append_reply(int op, int status, off_t end, struct reply_sink *sink);
+
+// Render the current time as a "timestamp:" line; returns its length.
+// Keeps a cached prefix, so only the thread that owns the timer may call it.
+size_t format_timestamp(char *buf, size_t size);
+
+// Append a timestamp line to the data file or device
+void write_timestamp(void);
+
+// Non-blocking timerfd armed to fire every config.timestamp_interval
+int timestamp_timer_create(void);
+
+// Block until a client connects, stamping on every timer_fd expiry meanwhile.
+// Returns the client socket, or -1 once the listener is shut down. ready is
+// set to when poll() reported the listener readable, for STAT_ACCEPT.
+int accept_client(int timer_fd, uint64_t *ready);
+
+// Registry entry for a client served by a blocking thread
+struct conn_slot {
+    pthread_t thread;                // Thread handle (thread mode only)
+    int client_fd;                   // Client socket file descriptor
+    LIST_ENTRY(conn_slot) entries;   // Active or free list linkage
+};
+
+// Slab backed connection registry, see registry.c
+struct conn_slot *registry_add(int client_fd);
+void registry_remove(struct conn_slot *slot);   // Also closes the slot's client_fd
+size_t registry_active(void);
+void registry_shutdown_all(void);
+void registry_wait_empty(void);
+void registry_drain(int timeout_ms);
+void registry_destroy(void);
+
+// Consistent view of the history mirror, see history.c
+struct history_span;
+struct history_snapshot {
+    uint64_t generation;             // Appends seen when the snapshot was taken
+    size_t total_len;
+    uint64_t appended;               // Bytes ever appended, evicted ones included
+    size_t count;
+    struct history_span *spans;
+};
+
+int history_init(void);
+int history_append(const char *data, size_t len);
+int history_snapshot(struct history_snapshot *snap);
+// Send the snapshot from byte start of what it holds
+int history_send(const struct history_snapshot *snap, size_t start, struct reply_sink *sink);
+void history_release(struct history_snapshot *snap);
+// Copy the mirror to or from a descriptor, for handing it to a new process
+int history_save(int fd);
+int history_load(int fd);
+// Drop the oldest entries until at most keep bytes remain (-R only)
+void history_trim(size_t keep);
+void history_destroy(void);
+
+// One line waiting for the group commit writer, see writer.c
+struct append_req {
+    struct append_req *next;
+    const char *data;
+    size_t len;
+    off_t end;                       // History length just past this line; on evicting
+                                     // backends, bytes ever appended through the writer
+    int status;                      // 0 once committed, -1 if the write failed
+    sem_t done;                      // Posted by the writer when the request completes
+    // Called by the writer thread instead of posting done. It runs with no
+    // lock held, after end and status are set, and must not block.
+    void (*on_done)(struct append_req *req);
+    void *ctx;                       // For on_done
+};
+
+int writer_start(void);
+void writer_stop(void);
+
+// Queue a line for the writer and block until it is on disk
+int writer_append(const char *data, size_t len, off_t *end);
+
+// Queue req, with data, len, on_done and ctx filled in, and return at once.
+// req and its data must stay valid until on_done has been called.
+void writer_submit(struct append_req *req);
+
+// Queue count lines, filled in data and len, so they are committed in one
+// backend append, and block until then; every request gets the same status
+int writer_append_batch(struct append_req *reqs, size_t count);
+
+// end of the last committed line, in append_req.end terms; hold file_mutex
+off_t writer_history_end(void);
+
+/*
+ * A -S storage backend, see storage.c. The writer thread is the only caller
+ * of append, and it holds file_mutex while it does. Stable backends never
+ * move a committed byte: they provide length and send, and a reply needs no
+ * lock. Evicting backends drop their oldest entries: they provide snapshot,
+ * which like seek must be called with file_mutex held.
+ */
+struct storage_ops {
+    const char *name;
+    const char *path;                // What replies and io_uring open, NULL if none
+    bool evicts;                     // Keeps only the newest max_entries appends
+    bool uring;                      // io_uring can append to and read path directly
+    bool retains;                    // -R can bound it: freed offsets cost nothing
+    size_t max_entries;
+    int (*reset)(void);              // Empty it at startup (not after a handoff)
+    off_t (*open)(void);             // Start appending; returns the length held
+    // Returns how many requests of batch, in order, are wholly committed. A
+    // failure commits only that prefix; no part of a later request remains.
+    size_t (*append)(const struct append_req *batch);
+    void (*close)(void);
+    void (*discard)(void);           // At exit, unless handing off
+    off_t (*length)(struct reply_sink *sink);
+    void (*send)(struct reply_sink *sink, off_t start, off_t end);
+    ssize_t (*snapshot)(struct reply_sink *sink, off_t start, size_t max);
+    // Position of byte offset of write cmd, as AESDCHAR_IOCSEEKTO, or -1
+    off_t (*seek)(struct reply_sink *sink, uint32_t cmd, uint32_t offset);
+    int (*save)(int fd);             // State a successor cannot find on disk
+    int (*load)(int fd);
+};
+
+// The backend called name, or NULL
+const struct storage_ops *storage_find(const char *name);
+
+// Memory mapped DATA_FILE for -S mmap, see maplog.c. Only the writer appends;
+// bytes below maplog_length() never change and may be read without a lock.
+int maplog_open(const char *path);
+size_t maplog_append_batch(const struct append_req *batch);
+size_t maplog_length(void);
+const char *maplog_data(void);
+void maplog_close(void);
+
+// Retained window of DATA_FILE under -R, see segment.c. Offsets are absolute
+// file offsets. The pin and unpin calls return 0 and do nothing without -R.
+int segment_init(void);
+void segment_append(off_t start, size_t len);   // One entry was appended at start
+off_t segment_retain(void);                     // Apply the limits; returns the window start
+off_t segment_pin(void);                        // Window start, held until segment_unpin()
+void segment_unpin(off_t base);
+int segment_save(int fd);
+int segment_load(int fd);
+void segment_destroy(void);
+
+// Shared tail of committed appends for AESD_SUBSCRIBE clients, see broadcast.c
+struct broadcast_block;
+struct broadcast_span {
+    struct broadcast_block *block;   // Reference held until broadcast_release()
+    const char *data;
+    size_t len;
+};
+
+// Called by whatever committed the bytes, in commit order
+void broadcast_publish(const char *data, size_t len);
+// The first count requests of batch
+void broadcast_publish_batch(const struct append_req *batch, size_t count);
+
+// Start a cursor at the current tail. Nothing is published while no cursor
+// is subscribed, so every subscribe needs a matching unsubscribe.
+void broadcast_subscribe(struct broadcast_cursor *cursor);
+void broadcast_unsubscribe(void);
+
+// Take what is available past the cursor, up to a block boundary. Returns 1
+// with span filled, 0 if there is nothing new (possibly after skipping a
+// lagging cursor to the tail), or -1 if the subscriber must be dropped.
+int broadcast_peek(struct broadcast_cursor *cursor, struct broadcast_span *span);
+void broadcast_advance(struct broadcast_cursor *cursor, const struct broadcast_span *span, size_t sent);
+void broadcast_release(struct broadcast_span *span);
+
+// Send everything available to fd. Returns 0 once caught up, 1 if a
+// non-blocking fd filled up, or -1 if the send failed or the subscriber was dropped.
+int broadcast_send(int fd, struct broadcast_cursor *cursor, int flags);
+
+// Block until something is published past the cursor or timeout_ms passes
+void broadcast_wait(const struct broadcast_cursor *cursor, int timeout_ms);
+
+// Have an event loop's eventfd written on every publish
+int broadcast_watch(int event_fd);
+void broadcast_unwatch(int event_fd);
+void broadcast_destroy(void);
+
+// Hot upgrade on SIGUSR2, see handoff.c
+#define HANDOFF_DRAIN_MS 1000  // How long in-flight requests get to finish
+
+int handoff_init(int argc, char *argv[]);   // Start the upgrade thread
+void handoff_request(void);                 // Async-signal-safe, from the SIGUSR2 handler
+bool handoff_pending(void);                 // A successor is waiting for our state
+int handoff_finish(void);                   // Send it the listeners and history
+void handoff_stop(void);
+void handoff_add_listener(int fd);          // Include fd in the next handoff
+
+// Move exactly len bytes over a blocking descriptor; -1 on error or EOF
+int write_full(int fd, const void *buf, size_t len);
+int read_full(int fd, void *buf, size_t len);
+
+// Successor side: take over from the predecessor on fd, then acknowledge once up
+int handoff_adopt(int fd);
+int handoff_take_listener(void);            // Next inherited shard listener, or -1
+int handoff_take_local_listener(void);      // Inherited -U listener, or -1
+int handoff_take_udp_socket(void);          // Inherited -u socket, or -1
+void handoff_ready(int fd);
+
+// Highest level aesd_log() compiles in; build with -DAESD_LOG_LEVEL=LOG_DEBUG for more
+#ifndef AESD_LOG_LEVEL
+#define AESD_LOG_LEVEL LOG_INFO
+#endif
+
+// Per call site state for aesd_log_ratelimited()
+struct log_ratelimit {
+    long window;             // Second the current burst started in
+    unsigned count;
+    unsigned suppressed;
+};
+
+// Asynchronous logger, see log.c
+int log_start(void);
+void log_stop(void);
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+bool log_ratelimit(struct log_ratelimit *rl, unsigned *suppressed);
+
+#define aesd_log(level, ...) do { \
+    if ((level) <= AESD_LOG_LEVEL) log_write((level), __VA_ARGS__); \
+} while (0)
+
+// For errors a misbehaving client can trigger once per request
+#define aesd_log_ratelimited(level, ...) do { \
+    static struct log_ratelimit rl_; \
+    unsigned suppressed_; \
+    if ((level) <= AESD_LOG_LEVEL && log_ratelimit(&rl_, &suppressed_)) { \
+        if (suppressed_) log_write((level), "%u similar message(s) suppressed", suppressed_); \
+        log_write((level), __VA_ARGS__); \
+    } \
+} while (0)
+
+// Operations timed by the latency histograms, see stats.c
+typedef enum {
+    STAT_ACCEPT = 0,
+    STAT_RECV,
+    STAT_APPEND,
+    STAT_SEND,
+    STAT_SEEK,
+    STAT_LOCK_WAIT,
+    STAT_OP_COUNT,
+} stat_op_t;
+
+typedef enum {
+    STAT_BYTES_IN = 0,
+    STAT_BYTES_OUT,
+    STAT_MESSAGES,
+    STAT_CONNECTIONS,
+    STAT_SUBSCRIBER_SKIPS,
+    STAT_SUBSCRIBER_DROPS,
+    STAT_SEGMENTS_DROPPED,
+    STAT_ARENA_MISSES,
+    STAT_FAIR_DEFERRALS,
+    STAT_UDP_BATCHES,
+    STAT_UDP_DROPS,
+    STAT_COUNTER_COUNT,
+} stat_counter_t;
+
+uint64_t stats_now(void);
+void stats_record(stat_op_t op, uint64_t start_ns);  // Records now - start_ns
+void stats_add(stat_counter_t counter, uint64_t n);
+void stats_conn_open(void);
+void stats_conn_close(void);
+void stats_lock(pthread_mutex_t *mutex);             // pthread_mutex_lock, timing any wait
+
+// Render every histogram and counter as text; returns the length written
+size_t stats_report(char *buf, size_t size);
+
+// Serve one client on a blocking socket until it disconnects. The socket is
+// left open for registry_remove() to close. arena is the calling worker's,
+// or NULL for buffers on the stack and heap.
+void serve_client(int client_fd, struct buf_arena *arena);
+
+// Run the worker pool accept loop until stop_flag is set, stamping on timer_fd
+// expiries; returns 0 on clean exit
+int run_pool(int timer_fd);
+
+// Create a socket bound to port, joining its SO_REUSEPORT group if reuseport
+int get_listener_socket(const char *port, bool reuseport);
+
+// Run the epoll reactor (epoll and shard modes) until stop_flag is set; returns 0 on clean exit
+int run_reactor(void);
+
+// Run the io_uring backend until stop_flag is set; returns 0 on clean exit
+int run_uring(void);
+
+#endif /* AESDSOCKET_H */
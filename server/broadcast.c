@@ -0,0 +1,323 @@
+/***********************************************************************
+* @file  broadcast.c
+* @version 1
+* @brief  Shared broadcast ring feeding AESD_SUBSCRIBE clients
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*   1 Skipped cursors resync at the next '\n'; nothing is published without subscribers
+*
+* Whatever commits appends (the writer thread, or the io_uring loop) also
+* publishes every committed line here. The ring holds the last
+* BROADCAST_BLOCKS blocks of BROADCAST_BLOCK_SIZE bytes, addressed by the
+* byte position since startup. A subscriber is just a cursor. It takes a
+* reference on the block under its cursor and sends from the shared block
+* itself, so one copy in serves every subscriber.
+*
+* Publishing never waits for subscribers. When a slot is needed again and
+* a subscriber still holds the block, that block is left to the subscriber
+* and the slot gets a fresh one. A subscriber whose position has been
+* overwritten skips to the tail. A binary APPEND need not end with '\n', so
+* the tail may fall inside a line, and then the subscriber drops bytes up to
+* and including the next '\n' before it sends again. If it had already been
+* sent part of a line, skipping would splice two lines together, so it is
+* dropped instead.
+*
+* While no client is subscribed nothing is copied in. Only whether the tail
+* is inside a line is kept, for the next subscriber, and that takes the mutex
+* just when it changes.
+*
+* Blocking subscriber threads wait on a condition variable. Event loops
+* register an eventfd, and it is written once per publish.
+*/
+
+#define _GNU_SOURCE  // MSG_NOSIGNAL
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+
+#define BROADCAST_BLOCK_SIZE 65536
+#define BROADCAST_BLOCKS 16       // Ring holds the last 1 MiB published
+#define BROADCAST_WATCHERS 256    // Event loops, not subscribers
+
+struct broadcast_block {
+    unsigned int refs;            // One for the ring, one per span holding it
+    uint64_t base;                // Position of data[0]
+    char data[BROADCAST_BLOCK_SIZE];
+};
+
+static pthread_mutex_t broadcast_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t broadcast_cond = PTHREAD_COND_INITIALIZER;
+static struct broadcast_block *slots[BROADCAST_BLOCKS];
+static uint64_t published;        // Bytes ever published
+static bool tail_in_line;         // The last byte published was not a '\n'
+static unsigned subscribers;      // Cursors between subscribe and unsubscribe
+static int watchers[BROADCAST_WATCHERS];
+static int watcher_count;
+
+static void block_put(struct broadcast_block *block) {
+    if (__atomic_sub_fetch(&block->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(block);
+    }
+}
+
+// Copy data in at the tail; caller holds broadcast_mutex
+static void publish_locked(const char *data, size_t len) {
+    while (len > 0) {
+        uint64_t base = published - published % BROADCAST_BLOCK_SIZE;
+        size_t off = published % BROADCAST_BLOCK_SIZE;
+        struct broadcast_block **slot = &slots[(base / BROADCAST_BLOCK_SIZE) % BROADCAST_BLOCKS];
+        size_t n = BROADCAST_BLOCK_SIZE - off;
+        if (n > len) n = len;
+
+        struct broadcast_block *block = *slot;
+        if (!block || block->base != base) {
+            // Reuse the old block only if no subscriber is still sending from it
+            if (!block || __atomic_load_n(&block->refs, __ATOMIC_ACQUIRE) != 1) {
+                if (block) {
+                    block_put(block);
+                }
+                block = malloc(sizeof(*block));
+                *slot = block;
+                if (!block) {
+                    // Subscribers that reach the gap skip past it
+                    aesd_log_ratelimited(LOG_ERR, "Failed to allocate broadcast block");
+                    published += n;
+                    data += n;
+                    len -= n;
+                    continue;
+                }
+                block->refs = 1;
+            }
+            block->base = base;
+        }
+        // Past the published position, so no subscriber reads this copy
+        memcpy(block->data + off, data, n);
+        published += n;
+        data += n;
+        len -= n;
+    }
+}
+
+// The bytes need not be copied in when nobody is subscribed; only the one
+// thread that publishes writes tail_in_line
+static bool nobody_listening(bool ends_in_line) {
+    if (__atomic_load_n(&subscribers, __ATOMIC_RELAXED) != 0) {
+        return false;
+    }
+    if (__atomic_load_n(&tail_in_line, __ATOMIC_RELAXED) == ends_in_line) {
+        return true;
+    }
+    pthread_mutex_lock(&broadcast_mutex);
+    bool idle = subscribers == 0;
+    if (idle) {
+        __atomic_store_n(&tail_in_line, ends_in_line, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&broadcast_mutex);
+    return idle;
+}
+
+// Wake everyone waiting on the ring; caller holds broadcast_mutex
+static void notify_locked(void) {
+    pthread_cond_broadcast(&broadcast_cond);
+    uint64_t one = 1;
+    for (int i = 0; i < watcher_count; i++) {
+        // A full counter is already readable, which is all a watcher needs
+        ssize_t rc = write(watchers[i], &one, sizeof(one));
+        (void)rc;
+    }
+}
+
+void broadcast_publish(const char *data, size_t len) {
+    if (len == 0 || nobody_listening(data[len - 1] != '\n')) {
+        return;
+    }
+    pthread_mutex_lock(&broadcast_mutex);
+    publish_locked(data, len);
+    __atomic_store_n(&tail_in_line, data[len - 1] != '\n', __ATOMIC_RELAXED);
+    notify_locked();
+    pthread_mutex_unlock(&broadcast_mutex);
+}
+
+void broadcast_publish_batch(const struct append_req *batch, size_t count) {
+    bool ends_in_line = __atomic_load_n(&tail_in_line, __ATOMIC_RELAXED);
+    const struct append_req *req = batch;
+    for (size_t i = 0; i < count; i++, req = req->next) {
+        if (req->len > 0) {
+            ends_in_line = req->data[req->len - 1] != '\n';
+        }
+    }
+    if (nobody_listening(ends_in_line)) {
+        return;
+    }
+    pthread_mutex_lock(&broadcast_mutex);
+    req = batch;
+    for (size_t i = 0; i < count; i++, req = req->next) {
+        publish_locked(req->data, req->len);
+    }
+    __atomic_store_n(&tail_in_line, ends_in_line, __ATOMIC_RELAXED);
+    notify_locked();
+    pthread_mutex_unlock(&broadcast_mutex);
+}
+
+void broadcast_subscribe(struct broadcast_cursor *cursor) {
+    pthread_mutex_lock(&broadcast_mutex);
+    cursor->pos = published;
+    cursor->partial = false;
+    cursor->resync = tail_in_line;
+    __atomic_store_n(&subscribers, subscribers + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&broadcast_mutex);
+}
+
+void broadcast_unsubscribe(void) {
+    pthread_mutex_lock(&broadcast_mutex);
+    __atomic_store_n(&subscribers, subscribers - 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&broadcast_mutex);
+}
+
+int broadcast_peek(struct broadcast_cursor *cursor, struct broadcast_span *span) {
+    pthread_mutex_lock(&broadcast_mutex);
+    for (;;) {
+        if (cursor->pos == published) {
+            pthread_mutex_unlock(&broadcast_mutex);
+            return 0;
+        }
+
+        uint64_t base = cursor->pos - cursor->pos % BROADCAST_BLOCK_SIZE;
+        struct broadcast_block *block = slots[(base / BROADCAST_BLOCK_SIZE) % BROADCAST_BLOCKS];
+        if (!block || block->base != base) {
+            unsigned long long behind = published - cursor->pos;
+            if (cursor->partial) {
+                pthread_mutex_unlock(&broadcast_mutex);
+                stats_add(STAT_SUBSCRIBER_DROPS, 1);
+                aesd_log_ratelimited(LOG_WARNING, "Subscriber fell %llu bytes behind mid-line, dropping it", behind);
+                return -1;
+            }
+            cursor->pos = published;
+            cursor->resync = tail_in_line;
+            pthread_mutex_unlock(&broadcast_mutex);
+            stats_add(STAT_SUBSCRIBER_SKIPS, 1);
+            aesd_log_ratelimited(LOG_WARNING, "Subscriber fell %llu bytes behind, skipped to the tail", behind);
+            return 0;
+        }
+
+        uint64_t end = base + BROADCAST_BLOCK_SIZE;
+        if (end > published) end = published;
+        const char *data = block->data + (cursor->pos - base);
+        size_t len = end - cursor->pos;
+        if (cursor->resync) {
+            // Nothing of this line was sent, so it is dropped whole
+            const char *newline = memchr(data, '\n', len);
+            size_t skip = newline ? (size_t)(newline - data) + 1 : len;
+            cursor->pos += skip;
+            cursor->resync = newline == NULL;
+            continue;
+        }
+        __atomic_add_fetch(&block->refs, 1, __ATOMIC_RELAXED);
+        span->block = block;
+        span->data = data;
+        span->len = len;
+        pthread_mutex_unlock(&broadcast_mutex);
+        return 1;
+    }
+}
+
+void broadcast_advance(struct broadcast_cursor *cursor, const struct broadcast_span *span, size_t sent) {
+    if (sent > 0) {
+        cursor->pos += sent;
+        cursor->partial = span->data[sent - 1] != '\n';
+    }
+}
+
+void broadcast_release(struct broadcast_span *span) {
+    if (span->block) {
+        block_put(span->block);
+        span->block = NULL;
+    }
+}
+
+int broadcast_send(int fd, struct broadcast_cursor *cursor, int flags) {
+    struct broadcast_span span;
+    int rc;
+    while ((rc = broadcast_peek(cursor, &span)) == 1) {
+        ssize_t sent = send(fd, span.data, span.len, flags | MSG_NOSIGNAL);
+        if (sent == -1) {
+            broadcast_release(&span);
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            aesd_log_ratelimited(LOG_ERR, "Send failed: %s", strerror(errno));
+            return -1;
+        }
+        stats_add(STAT_BYTES_OUT, sent);
+        broadcast_advance(cursor, &span, sent);
+        broadcast_release(&span);
+    }
+    return rc;
+}
+
+void broadcast_wait(const struct broadcast_cursor *cursor, int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&broadcast_mutex);
+    while (cursor->pos == published) {
+        if (pthread_cond_timedwait(&broadcast_cond, &broadcast_mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&broadcast_mutex);
+}
+
+int broadcast_watch(int event_fd) {
+    pthread_mutex_lock(&broadcast_mutex);
+    int rc = -1;
+    if (watcher_count < BROADCAST_WATCHERS) {
+        watchers[watcher_count++] = event_fd;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&broadcast_mutex);
+    if (rc == -1) {
+        syslog(LOG_ERR, "Too many broadcast watchers");
+    }
+    return rc;
+}
+
+void broadcast_unwatch(int event_fd) {
+    pthread_mutex_lock(&broadcast_mutex);
+    for (int i = 0; i < watcher_count; i++) {
+        if (watchers[i] == event_fd) {
+            watchers[i] = watchers[--watcher_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&broadcast_mutex);
+}
+
+void broadcast_destroy(void) {
+    pthread_mutex_lock(&broadcast_mutex);
+    for (int i = 0; i < BROADCAST_BLOCKS; i++) {
+        if (slots[i]) {
+            block_put(slots[i]);
+            slots[i] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&broadcast_mutex);
+}
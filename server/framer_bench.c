@@ -0,0 +1,133 @@
+/***********************************************************************
+* @file  framer_bench.c
+* @version 0
+* @brief  Microbenchmark of the line framer against the per-byte loop
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*
+* Build with "make bench" and run ./framer_bench [line_len] [chunk_len].
+* The same input is fed through the old connection_handler loop, which copies
+* one byte at a time into a BUF_SIZE buffer, and through framer_feed(). Each
+* reports bytes per TSC cycle on x86, and bytes per nanosecond elsewhere.
+*/
+
+#define _POSIX_C_SOURCE 200112L  // Enable POSIX features
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "aesdsocket.h"
+
+#define BENCH_TOTAL (64 * 1024 * 1024)  // Bytes fed per run
+#define BENCH_RUNS 5
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT "cycle"
+static unsigned long long bench_now(void) {
+    return __rdtsc();
+}
+#else
+#define BENCH_UNIT "ns"
+static unsigned long long bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+static size_t lines_seen;
+static size_t bytes_seen;
+
+static void count_message(void *ctx, int op, const char *msg, size_t len) {
+    (void)ctx;
+    (void)op;
+    lines_seen++;
+    bytes_seen += len + (unsigned char)msg[0] % 2;  // Touch the data
+}
+
+// The loop framer_feed() replaced, kept verbatim apart from the callback
+static void legacy_feed(char *message_buffer, size_t *message_length,
+                        const char *buf, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (*message_length < BUF_SIZE - 1) {
+            message_buffer[(*message_length)++] = buf[i];
+            if (buf[i] == '\n') {
+                message_buffer[*message_length] = '\0';
+                count_message(NULL, AESD_OP_LINE, message_buffer, *message_length);
+                *message_length = 0;
+            }
+        } else {
+            *message_length = 0;
+        }
+    }
+}
+
+static double run_legacy(const char *input, size_t total, size_t chunk) {
+    char message_buffer[BUF_SIZE];
+    size_t message_length = 0;
+    unsigned long long start = bench_now();
+    for (size_t off = 0; off < total; off += chunk) {
+        size_t n = total - off < chunk ? total - off : chunk;
+        legacy_feed(message_buffer, &message_length, input + off, n);
+    }
+    return (double)total / (double)(bench_now() - start);
+}
+
+static double run_framer(const char *input, size_t total, size_t chunk) {
+    struct line_framer framer;
+    framer_init(&framer, MAX_LINE_DEFAULT, NULL);
+    unsigned long long start = bench_now();
+    for (size_t off = 0; off < total; off += chunk) {
+        size_t n = total - off < chunk ? total - off : chunk;
+        framer_feed(&framer, input + off, n, count_message, NULL);
+    }
+    double rate = (double)total / (double)(bench_now() - start);
+    framer_free(&framer);
+    return rate;
+}
+
+int main(int argc, char *argv[]) {
+    size_t line_len = argc > 1 ? strtoul(argv[1], NULL, 10) : 80;
+    size_t chunk = argc > 2 ? strtoul(argv[2], NULL, 10) : BUF_SIZE;
+    if (line_len < 1 || chunk < 1) {
+        fprintf(stderr, "Usage: %s [line_len] [chunk_len]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char *input = malloc(BENCH_TOTAL);
+    if (!input) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < BENCH_TOTAL; i++) {
+        input[i] = (i + 1) % line_len == 0 ? '\n' : 'a' + i % 26;
+    }
+
+    double best_legacy = 0, best_framer = 0;
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        double rate = run_legacy(input, BENCH_TOTAL, chunk);
+        if (rate > best_legacy) best_legacy = rate;
+        rate = run_framer(input, BENCH_TOTAL, chunk);
+        if (rate > best_framer) best_framer = rate;
+    }
+
+    printf("line %zu B, chunk %zu B, %d MiB per run\n",
+           line_len, chunk, BENCH_TOTAL >> 20);
+    printf("  per-byte loop: %6.3f bytes/%s\n", best_legacy, BENCH_UNIT);
+    printf("  framer_feed:   %6.3f bytes/%s (%.1fx)\n",
+           best_framer, BENCH_UNIT, best_framer / best_legacy);
+    if (line_len >= BUF_SIZE) {
+        printf("  (the per-byte loop drops lines of %d bytes or more)\n", BUF_SIZE);
+    }
+    free(input);
+    return bytes_seen == 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
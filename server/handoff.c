@@ -0,0 +1,499 @@
+/***********************************************************************
+* @file  handoff.c
+* @version 5
+* @brief  Hot upgrade: hand the listeners and history to a new aesdsocket
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*   1 Carry the -R segment table, so the successor keeps the same window
+*   2 Carry the -S memory backend's entries, which live only in this process
+*   3 The -U listener goes along, recognised by its address family
+*   4 The -u UDP socket goes along, recognised by its socket type
+*   5 Failed adoption closes the received descriptors instead of leaving them adopted
+*
+* SIGUSR2 wakes the upgrade thread. It execs whatever binary is now installed
+* at this process's path, with the same arguments plus -H 3. The successor
+* gets one end of a UNIX socketpair as fd 3, and every other descriptor is
+* closed. The old process keeps serving until the successor reports that it
+* is up. If that never happens, it kills the successor and carries on.
+*
+* Once the successor has reported in, the old process stops its loops. It
+* lets in-flight requests finish for up to HANDOFF_DRAIN_MS and commits what
+* the writer has queued. It then sends every listening socket, and the -u
+* UDP socket, with SCM_RIGHTS, followed by the history mirror, and waits for
+* the successor to acknowledge before it exits. The sockets are never closed
+* or shut down, so clients that connect meanwhile wait in the backlog instead
+* of being refused, and datagrams wait in the receive buffer. The old process
+* also leaves DATA_FILE in place. A backend that keeps its history in memory
+* sends that too.
+*
+* Protocol on the socketpair, successor first:
+*   successor  HANDOFF_HELLO once exec'd and its options parsed
+*   old        struct handoff_header, carrying the listener fds
+*   old        the mirror in history_save() format, if header.history is set
+*   old        the segment table in segment_save() format, if header.segments is set
+*   old        the backend's entries in its save() format, if header.storage is set
+*   successor  HANDOFF_ACK once its writer and logger are running
+*
+*Ref:
+* 1. unix(7) SCM_RIGHTS, socketpair(2), cmsg(3)
+*/
+
+#define _GNU_SOURCE  // MSG_CMSG_CLOEXEC
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include "aesdsocket.h"
+
+#define HANDOFF_FD 3              // Where the successor finds its end of the socketpair
+#define HANDOFF_MAX_LISTENERS 256
+#define HANDOFF_HELLO 'H'
+#define HANDOFF_ACK 'A'
+#define HANDOFF_MAGIC 0x41455344  // "AESD"
+#define HANDOFF_START_MS 5000     // How long the successor has to report in
+
+struct handoff_header {
+    uint32_t magic;
+    uint32_t listeners;           // Number of fds in the SCM_RIGHTS message
+    uint32_t history;             // 1 if the mirror follows
+    uint32_t segments;            // 1 if the -R segment table follows
+    uint32_t storage;             // 1 if the storage backend's state follows
+};
+
+static pthread_mutex_t handoff_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int listeners[HANDOFF_MAX_LISTENERS];  // Our own dups, sent on upgrade
+static int listener_count;
+static int adopted[HANDOFF_MAX_LISTENERS];    // Received, not yet taken by a shard
+static int adopted_count;
+static int adopted_local = -1;                // Received -U listener, not yet taken
+static int adopted_udp = -1;                  // Received -u socket, not yet taken
+
+static char exe_path[4096];
+static char **child_argv;
+static int upgrade_fd = -1;       // eventfd the SIGUSR2 handler writes
+static pthread_t upgrade_thread;
+static bool upgrade_running;
+static volatile bool upgrade_stopping;
+static volatile int successor_fd = -1;
+static pid_t successor_pid;
+
+int write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_byte(int fd, char c) {
+    ssize_t n;
+    while ((n = write(fd, &c, 1)) == -1 && errno == EINTR) {
+    }
+    return n == 1 ? 0 : -1;
+}
+
+void handoff_add_listener(int fd) {
+    pthread_mutex_lock(&handoff_mutex);
+    // A dup keeps the socket listening even after its owner closes its copy
+    int copy = listener_count < HANDOFF_MAX_LISTENERS ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+    if (copy != -1) {
+        listeners[listener_count++] = copy;
+    }
+    pthread_mutex_unlock(&handoff_mutex);
+    if (copy == -1) {
+        syslog(LOG_ERR, "Listener %d will not survive an upgrade", fd);
+    }
+}
+
+int handoff_take_listener(void) {
+    pthread_mutex_lock(&handoff_mutex);
+    int fd = adopted_count > 0 ? adopted[--adopted_count] : -1;
+    pthread_mutex_unlock(&handoff_mutex);
+    return fd;
+}
+
+int handoff_take_local_listener(void) {
+    pthread_mutex_lock(&handoff_mutex);
+    int fd = adopted_local;
+    adopted_local = -1;
+    pthread_mutex_unlock(&handoff_mutex);
+    return fd;
+}
+
+int handoff_take_udp_socket(void) {
+    pthread_mutex_lock(&handoff_mutex);
+    int fd = adopted_udp;
+    adopted_udp = -1;
+    pthread_mutex_unlock(&handoff_mutex);
+    return fd;
+}
+
+static bool is_local_socket(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    return getsockname(fd, (struct sockaddr *)&addr, &len) == 0 && addr.ss_family == AF_UNIX;
+}
+
+static bool is_datagram_socket(int fd) {
+    int type;
+    socklen_t len = sizeof(type);
+    return getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_DGRAM;
+}
+
+// In the forked child: put the socketpair on HANDOFF_FD, close the rest, exec
+static void exec_successor(int fd, int max_fd) {
+    if (fd != HANDOFF_FD) {
+        if (dup2(fd, HANDOFF_FD) == -1) {
+            _exit(127);
+        }
+    } else {
+        fcntl(fd, F_SETFD, 0);
+    }
+    #ifdef SYS_close_range
+    if (syscall(SYS_close_range, HANDOFF_FD + 1, ~0U, 0) == 0) {
+        max_fd = 0;
+    }
+    #endif
+    for (int i = HANDOFF_FD + 1; i < max_fd; i++) {
+        close(i);
+    }
+    execv(exe_path, child_argv);
+    _exit(127);
+}
+
+// Start the successor and wait for it to report in; 0 once it has
+static int spawn_successor(void) {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        syslog(LOG_ERR, "Upgrade: socketpair failed: %s", strerror(errno));
+        return -1;
+    }
+    struct rlimit rl;
+    int max_fd = (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+                 ? (int)rl.rlim_cur : 65536;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        syslog(LOG_ERR, "Upgrade: fork failed: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        exec_successor(sv[1], max_fd);
+    }
+    close(sv[1]);
+
+    struct pollfd pfd = { .fd = sv[0], .events = POLLIN };
+    char hello = 0;
+    int rc;
+    while ((rc = poll(&pfd, 1, HANDOFF_START_MS)) == -1 && errno == EINTR) {
+    }
+    if (rc == 1 && read_full(sv[0], &hello, 1) == 0 && hello == HANDOFF_HELLO) {
+        successor_pid = pid;
+        successor_fd = sv[0];
+        return 0;
+    }
+
+    syslog(LOG_ERR, "Upgrade: %s did not start, still serving", exe_path);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(sv[0]);
+    return -1;
+}
+
+static void *upgrade_thread_fn(void *arg) {
+    (void)arg;
+    for (;;) {
+        uint64_t count;
+        if (read(upgrade_fd, &count, sizeof(count)) == -1 && errno == EINTR) {
+            continue;
+        }
+        if (upgrade_stopping || stop_flag) {
+            break;
+        }
+        syslog(LOG_INFO, "Upgrade requested, starting %s", exe_path);
+        if (spawn_successor() == 0) {
+            // Stop the loops without shutting down the listener the successor gets
+            stop_flag = 1;
+            uint64_t one = 1;
+            if (wake_fd != -1 && write(wake_fd, &one, sizeof(one)) == -1) {
+                syslog(LOG_ERR, "Failed to wake the server loops: %s", strerror(errno));
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+int handoff_init(int argc, char *argv[]) {
+    ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    if (len <= 0) {
+        syslog(LOG_ERR, "Cannot find own executable, upgrades disabled");
+        return -1;
+    }
+    exe_path[len] = '\0';
+
+    // Same arguments minus any -H of our own, plus the successor's
+    child_argv = calloc(argc + 3, sizeof(*child_argv));
+    if (!child_argv) {
+        return -1;
+    }
+    int n = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-H") == 0) {
+            i++;
+            continue;
+        }
+        child_argv[n++] = argv[i];
+    }
+    child_argv[n++] = "-H";
+    child_argv[n++] = "3";
+    child_argv[n] = NULL;
+
+    upgrade_fd = eventfd(0, EFD_CLOEXEC);
+    if (upgrade_fd == -1) {
+        syslog(LOG_ERR, "Failed to create upgrade eventfd: %s", strerror(errno));
+        return -1;
+    }
+    if (pthread_create(&upgrade_thread, NULL, upgrade_thread_fn, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to create upgrade thread");
+        close(upgrade_fd);
+        upgrade_fd = -1;
+        return -1;
+    }
+    upgrade_running = true;
+    return 0;
+}
+
+void handoff_request(void) {
+    if (upgrade_fd != -1) {
+        uint64_t one = 1;
+        ssize_t rc = write(upgrade_fd, &one, sizeof(one));
+        (void)rc;
+    }
+}
+
+bool handoff_pending(void) {
+    return successor_fd != -1;
+}
+
+int handoff_finish(void) {
+    int fd = successor_fd;
+    struct handoff_header header = {
+        .magic = HANDOFF_MAGIC,
+        .listeners = listener_count,
+        .history = config.history_mirror,
+        .segments = config.retention.segment_size != 0,
+        .storage = config.storage->save != NULL,
+    };
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_LISTENERS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * listener_count),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * listener_count);
+    memcpy(CMSG_DATA(cmsg), listeners, sizeof(int) * listener_count);
+
+    ssize_t sent;
+    while ((sent = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+    }
+    if (sent != sizeof(header) || (header.history && history_save(fd) == -1) ||
+        (header.segments && segment_save(fd) == -1) ||
+        (header.storage && config.storage->save(fd) == -1)) {
+        syslog(LOG_ERR, "Upgrade: failed to hand off to pid %d: %s", (int)successor_pid, strerror(errno));
+        return -1;
+    }
+
+    char ack = 0;
+    if (read_full(fd, &ack, 1) == -1 || ack != HANDOFF_ACK) {
+        syslog(LOG_ERR, "Upgrade: pid %d did not take over", (int)successor_pid);
+        return -1;
+    }
+    syslog(LOG_INFO, "Upgrade: handed off %d listener(s) to pid %d", listener_count, (int)successor_pid);
+    return 0;
+}
+
+static void close_fds(const int *fds, int nfds) {
+    for (int i = 0; i < nfds; i++) {
+        close(fds[i]);
+    }
+}
+
+int handoff_adopt(int fd) {
+    if (write_byte(fd, HANDOFF_HELLO) == -1) {
+        syslog(LOG_ERR, "Upgrade: predecessor went away: %s", strerror(errno));
+        return -1;
+    }
+
+    struct handoff_header header;
+    struct iovec iov = { .iov_base = &header, .iov_len = sizeof(header) };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_LISTENERS)];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    ssize_t got;
+    while ((got = recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+    }
+
+    int fds[HANDOFF_MAX_LISTENERS];
+    int nfds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+        }
+    }
+    if (got != sizeof(header) || header.magic != HANDOFF_MAGIC || nfds == 0) {
+        syslog(LOG_ERR, "Upgrade: malformed handoff from predecessor");
+        close_fds(fds, nfds);
+        return -1;
+    }
+
+    // The predecessor's reactors may have made them non-blocking, and the
+    // flag lives on the shared socket; each mode sets what it needs
+    for (int i = 0; i < nfds; i++) {
+        int flags = fcntl(fds[i], F_GETFL);
+        if (flags != -1) {
+            fcntl(fds[i], F_SETFL, flags & ~O_NONBLOCK);
+        }
+    }
+
+    if (header.history) {
+        if (history_load(fd) == -1) {
+            syslog(LOG_ERR, "Upgrade: failed to load the history mirror");
+            close_fds(fds, nfds);
+            return -1;
+        }
+    } else if (config.history_mirror && history_init() == -1) {
+        syslog(LOG_ERR, "Failed to load history mirror: %s", strerror(errno));
+        close_fds(fds, nfds);
+        return -1;
+    }
+    if (header.segments && segment_load(fd) == -1) {
+        syslog(LOG_ERR, "Upgrade: failed to load the segment table");
+        close_fds(fds, nfds);
+        return -1;
+    }
+    // Both sides run with the same options, so the backends match
+    if (header.storage && (!config.storage->load || config.storage->load(fd) == -1)) {
+        syslog(LOG_ERR, "Upgrade: failed to load the %s backend", config.storage->name);
+        close_fds(fds, nfds);
+        return -1;
+    }
+
+    // Only now hand them out, so a failure above leaves nothing adopted.
+    // The first is the shared listener; shard reactors pick up the rest,
+    // except for the -U listener and the -u socket
+    sockfd = fds[0];
+    pthread_mutex_lock(&handoff_mutex);
+    for (int i = nfds - 1; i > 0; i--) {
+        if (adopted_local == -1 && is_local_socket(fds[i])) {
+            adopted_local = fds[i];
+        } else if (adopted_udp == -1 && is_datagram_socket(fds[i])) {
+            adopted_udp = fds[i];
+        } else {
+            adopted[adopted_count++] = fds[i];
+        }
+    }
+    pthread_mutex_unlock(&handoff_mutex);
+
+    syslog(LOG_INFO, "Upgrade: took over %d listener(s)", nfds);
+    return 0;
+}
+
+void handoff_ready(int fd) {
+    if (write_byte(fd, HANDOFF_ACK) == -1) {
+        syslog(LOG_ERR, "Upgrade: failed to acknowledge: %s", strerror(errno));
+    }
+    close(fd);
+}
+
+void handoff_stop(void) {
+    if (upgrade_running) {
+        upgrade_stopping = true;
+        handoff_request();
+        pthread_join(upgrade_thread, NULL);
+        upgrade_running = false;
+    }
+    if (upgrade_fd != -1) {
+        close(upgrade_fd);
+        upgrade_fd = -1;
+    }
+    if (successor_fd != -1) {
+        close(successor_fd);
+        successor_fd = -1;
+    }
+    pthread_mutex_lock(&handoff_mutex);
+    for (int i = 0; i < listener_count; i++) {
+        close(listeners[i]);
+    }
+    listener_count = 0;
+    for (int i = 0; i < adopted_count; i++) {
+        close(adopted[i]);
+    }
+    adopted_count = 0;
+    if (adopted_local != -1) {
+        close(adopted_local);
+        adopted_local = -1;
+    }
+    if (adopted_udp != -1) {
+        close(adopted_udp);
+        adopted_udp = -1;
+    }
+    pthread_mutex_unlock(&handoff_mutex);
+    free(child_argv);
+    child_argv = NULL;
+}
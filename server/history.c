@@ -0,0 +1,497 @@
+/***********************************************************************
+* @file  history.c
+* @version 6
+* @brief  In-memory mirror of the aesdsocket history
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*   1 Count bytes ever appended and send a snapshot from an offset, for delta replies
+*   2 Save and load the mirror over a descriptor for hot upgrades
+*   3 Under -R, one chunk per entry, trimmed to the retained window
+*   4 Entry limit and seed path come from the -S backend
+*   5 Hold back appends without a '\n' until one ends the entry, as the driver does
+*   6 Seed an evicting backend's mirror one chunk per driver entry, found by seeking
+*
+* The mirror is an append-only list of refcounted chunks plus a generation
+* counter bumped on every append. For the file and mmap backends, entries are
+* packed into HISTORY_BLOCK_SIZE blocks. For the char and memory backends,
+* each entry gets its own chunk, and the oldest is dropped once the
+* backend's max_entries limit is passed, so the mirror holds exactly what a
+* read of the backend returns. Like the driver, these backends hold an
+* append with no '\n' back and join it to the following ones, until an
+* append containing a '\n' ends the entry. Held-back bytes are not in any
+* snapshot or in the appended count. Under -R the file backend also
+* keeps one chunk per entry, and the writer trims whole entries to match the
+* retained window.
+*
+* A snapshot takes a reference on every chunk and records how much of the
+* tail chunk was valid, so it stays byte exact while appends continue and
+* evicted chunks live until the last snapshot using them is released.
+*/
+
+#define _GNU_SOURCE  // IOV_MAX
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+
+#define HISTORY_BLOCK_SIZE 65536  // Block size for the file backend
+
+struct history_chunk {
+    struct history_chunk *next;
+    unsigned int refs;         // One for the list, one per snapshot holding it
+    size_t len;                // Bytes written so far
+    size_t cap;
+    char data[];
+};
+
+// One chunk as seen by a snapshot
+struct history_span {
+    struct history_chunk *chunk;
+    size_t len;                // Valid bytes when the snapshot was taken
+};
+
+static pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct history_chunk *head, *tail;
+static size_t chunk_count;
+static size_t total_len;
+static uint64_t generation;
+static uint64_t appended;        // Bytes ever appended, evicted ones included
+static size_t max_entries;       // 0 when entries are never evicted
+static bool per_entry;           // One chunk per entry rather than packed blocks
+static char *held;               // Start of an entry still waiting for its '\n'
+static size_t held_len, held_cap;
+
+static struct history_chunk *chunk_new(size_t cap) {
+    struct history_chunk *chunk = malloc(sizeof(*chunk) + cap);
+    if (chunk) {
+        chunk->next = NULL;
+        chunk->refs = 1;
+        chunk->len = 0;
+        chunk->cap = cap;
+    }
+    return chunk;
+}
+
+static void chunk_put(struct history_chunk *chunk) {
+    if (__atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(chunk);
+    }
+}
+
+// Link a chunk at the tail; caller holds history_mutex
+static void chunk_link(struct history_chunk *chunk) {
+    if (tail) {
+        tail->next = chunk;
+    } else {
+        head = chunk;
+    }
+    tail = chunk;
+    chunk_count++;
+}
+
+// Drop the oldest entry the same way the driver's circular buffer does
+static void evict_oldest(void) {
+    struct history_chunk *old = head;
+    head = old->next;
+    if (!head) {
+        tail = NULL;
+    }
+    chunk_count--;
+    total_len -= old->len;
+    chunk_put(old);
+}
+
+static int append_locked(const char *data, size_t len) {
+    if (per_entry) {
+        struct history_chunk *chunk = chunk_new(len);
+        if (!chunk) {
+            return -1;
+        }
+        memcpy(chunk->data, data, len);
+        chunk->len = len;
+        chunk_link(chunk);
+        total_len += len;
+        if (max_entries && chunk_count > max_entries) {
+            evict_oldest();
+        }
+        return 0;
+    }
+
+    while (len > 0) {
+        if (!tail || tail->len == tail->cap) {
+            struct history_chunk *chunk = chunk_new(HISTORY_BLOCK_SIZE);
+            if (!chunk) {
+                return -1;
+            }
+            chunk_link(chunk);
+        }
+        size_t n = tail->cap - tail->len;
+        if (n > len) n = len;
+        // Bytes past every snapshot's recorded length, so readers never see this copy
+        memcpy(tail->data + tail->len, data, n);
+        tail->len += n;
+        total_len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Join data to the held-back entry, and add that entry once data holds a
+// '\n'. committed is set to the bytes that became visible. Caller holds
+// history_mutex.
+static int hold_locked(const char *data, size_t len, size_t *committed) {
+    *committed = 0;
+    if (held_len + len > held_cap) {
+        size_t cap = held_cap ? held_cap : BUF_SIZE;
+        while (cap < held_len + len) cap *= 2;
+        char *grown = realloc(held, cap);
+        if (!grown) {
+            return -1;
+        }
+        held = grown;
+        held_cap = cap;
+    }
+    memcpy(held + held_len, data, len);
+    held_len += len;
+    if (!memchr(data, '\n', len)) {
+        return 0;
+    }
+    if (append_locked(held, held_len) == -1) {
+        return -1;
+    }
+    *committed = held_len;
+    held_len = 0;
+    return 0;
+}
+
+// New appends are merged like the driver's writes; seeded and loaded entries
+// are already whole
+static int history_add(const char *data, size_t len, bool merge) {
+    pthread_mutex_lock(&history_mutex);
+    size_t committed = len;
+    int rc;
+    if (merge && max_entries && (held_len || !memchr(data, '\n', len))) {
+        rc = hold_locked(data, len, &committed);
+    } else {
+        rc = append_locked(data, len);
+    }
+    generation++;
+    if (rc == 0) {
+        appended += committed;
+    }
+    pthread_mutex_unlock(&history_mutex);
+    if (rc == -1) {
+        aesd_log_ratelimited(LOG_ERR, "Failed to grow history mirror");
+    }
+    return rc;
+}
+
+int history_append(const char *data, size_t len) {
+    return history_add(data, len, true);
+}
+
+// How entries are kept, from the -S backend and the -R options
+static void history_setup(void) {
+    max_entries = config.storage->evicts ? config.storage->max_entries : 0;
+    per_entry = max_entries != 0 || config.retention.segment_size != 0;
+}
+
+/*
+ * A read of the driver runs its entries together, and one entry may hold
+ * several lines. AESDCHAR_IOCSEEKTO to offset 0 of each entry finds where
+ * they start. Fills starts and returns how many entries there are, or 0 if
+ * they could not be found within len bytes.
+ */
+static size_t entry_starts(off_t *starts, size_t len) {
+    struct reply_sink sink = { .sock_fd = -1, .data_fd = -1 };
+    size_t count = 0;
+    while (count < max_entries) {
+        off_t pos = config.storage->seek(&sink, count, 0);
+        if (pos == -1) {
+            break;
+        }
+        if (pos < (count ? starts[count - 1] + 1 : 0) || (size_t)pos >= len) {
+            count = 0;
+            break;
+        }
+        starts[count++] = pos;
+    }
+    reply_sink_release(&sink);
+    return count > 0 && starts[0] == 0 ? count : 0;
+}
+
+int history_init(void) {
+    history_setup();
+
+    // Seed from whatever the backend's file already holds: one entry per driver
+    // entry where the backend can seek to them, otherwise one per line
+    if (!config.storage->path) {
+        return 0;
+    }
+    int fd = open(config.storage->path, O_RDONLY);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    char *buf = NULL;
+    size_t len = 0, cap = 0;
+    ssize_t bytes_read;
+    do {
+        if (cap - len < BUF_SIZE) {
+            cap = cap ? cap * 2 : 4 * BUF_SIZE;
+            char *grown = realloc(buf, cap);
+            if (!grown) {
+                free(buf);
+                close(fd);
+                return -1;
+            }
+            buf = grown;
+        }
+        bytes_read = read(fd, buf + len, cap - len);
+        if (bytes_read > 0) len += bytes_read;
+    } while (bytes_read > 0 || (bytes_read == -1 && errno == EINTR));
+    close(fd);
+
+    int rc = 0;
+    size_t start = 0;
+    // One chunk per driver entry, so the mirror evicts what the driver does
+    off_t *starts = max_entries && config.storage->seek ? malloc(max_entries * sizeof(*starts)) : NULL;
+    size_t entries = starts ? entry_starts(starts, len) : 0;
+    for (size_t i = 0; i < entries && rc == 0; i++) {
+        size_t end = i + 1 < entries ? (size_t)starts[i + 1] : len;
+        rc = history_add(buf + starts[i], end - starts[i], false);
+        start = end;
+    }
+    free(starts);
+    // Otherwise one per line
+    while (start < len && rc == 0) {
+        char *newline = memchr(buf + start, '\n', len - start);
+        size_t end = newline ? (size_t)(newline - buf) + 1 : len;
+        rc = history_add(buf + start, end - start, false);
+        start = end;
+    }
+    free(buf);
+    return rc;
+}
+
+int history_snapshot(struct history_snapshot *snap) {
+    pthread_mutex_lock(&history_mutex);
+    snap->generation = generation;
+    snap->total_len = total_len;
+    snap->appended = appended;
+    snap->count = 0;
+    snap->spans = malloc((chunk_count ? chunk_count : 1) * sizeof(*snap->spans));
+    if (!snap->spans) {
+        pthread_mutex_unlock(&history_mutex);
+        aesd_log_ratelimited(LOG_ERR, "Failed to allocate history snapshot");
+        return -1;
+    }
+    for (struct history_chunk *chunk = head; chunk; chunk = chunk->next) {
+        __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+        snap->spans[snap->count].chunk = chunk;
+        snap->spans[snap->count].len = chunk->len;
+        snap->count++;
+    }
+    pthread_mutex_unlock(&history_mutex);
+    return 0;
+}
+
+void history_release(struct history_snapshot *snap) {
+    for (size_t i = 0; i < snap->count; i++) {
+        chunk_put(snap->spans[i].chunk);
+    }
+    free(snap->spans);
+    snap->spans = NULL;
+    snap->count = 0;
+}
+
+// Gather-write a snapshot from span next, byte skip on, to a blocking socket,
+// IOV_MAX chunks at a time
+static int writev_snapshot(int sock_fd, const struct history_snapshot *snap,
+                           size_t next, size_t skip) {
+    struct iovec iov[IOV_MAX];
+    while (next < snap->count) {
+        int iovcnt = 0;
+        while (next < snap->count && iovcnt < IOV_MAX) {
+            iov[iovcnt].iov_base = snap->spans[next].chunk->data + skip;
+            iov[iovcnt].iov_len = snap->spans[next].len - skip;
+            skip = 0;
+            iovcnt++;
+            next++;
+        }
+
+        struct iovec *cur = iov;
+        while (iovcnt > 0) {
+            ssize_t sent = writev(sock_fd, cur, iovcnt);
+            if (sent == -1) {
+                if (errno == EINTR) continue;
+                aesd_log_ratelimited(LOG_ERR, "Send failed: %s", strerror(errno));
+                return -1;
+            }
+            stats_add(STAT_BYTES_OUT, sent);
+            // Skip what went out, resuming mid-iovec after a short write
+            while (iovcnt > 0 && (size_t)sent >= cur->iov_len) {
+                sent -= cur->iov_len;
+                cur++;
+                iovcnt--;
+            }
+            if (iovcnt > 0) {
+                cur->iov_base = (char *)cur->iov_base + sent;
+                cur->iov_len -= sent;
+            }
+        }
+    }
+    return 0;
+}
+
+int history_send(const struct history_snapshot *snap, size_t start, struct reply_sink *sink) {
+    // Find the span holding byte start
+    size_t first = 0;
+    while (first < snap->count && start >= snap->spans[first].len) {
+        start -= snap->spans[first].len;
+        first++;
+    }
+    if (sink->sock_fd != -1) {
+        return writev_snapshot(sink->sock_fd, snap, first, start);
+    }
+    for (size_t i = first; i < snap->count; i++) {
+        const struct history_span *span = &snap->spans[i];
+        if (sink->write(sink->ctx, span->chunk->data + start, span->len - start) == -1) {
+            return -1;
+        }
+        start = 0;
+    }
+    return 0;
+}
+
+// One record per chunk, so the char device's entries keep their boundaries:
+// a uint64_t record count, then a uint64_t length and the bytes of each.
+// The held-back entry follows as one more length and bytes, length 0 if none.
+int history_save(int fd) {
+    struct history_snapshot snap;
+    if (history_snapshot(&snap) == -1) {
+        return -1;
+    }
+    pthread_mutex_lock(&history_mutex);
+    uint64_t partial_len = held_len;
+    char *partial = partial_len ? malloc(partial_len) : NULL;
+    if (partial) {
+        memcpy(partial, held, partial_len);
+    }
+    pthread_mutex_unlock(&history_mutex);
+    if (partial_len && !partial) {
+        history_release(&snap);
+        return -1;
+    }
+
+    uint64_t count = snap.count;
+    int rc = write_full(fd, &count, sizeof(count));
+    for (size_t i = 0; i < snap.count && rc == 0; i++) {
+        uint64_t len = snap.spans[i].len;
+        rc = write_full(fd, &len, sizeof(len));
+        if (rc == 0) {
+            rc = write_full(fd, snap.spans[i].chunk->data, len);
+        }
+    }
+    if (rc == 0) {
+        rc = write_full(fd, &partial_len, sizeof(partial_len));
+    }
+    if (rc == 0 && partial_len) {
+        rc = write_full(fd, partial, partial_len);
+    }
+    free(partial);
+    history_release(&snap);
+    return rc;
+}
+
+int history_load(int fd) {
+    history_setup();
+    uint64_t count;
+    if (read_full(fd, &count, sizeof(count)) == -1) {
+        return -1;
+    }
+    char *buf = NULL;
+    size_t cap = 0;
+    int rc = 0;
+    for (uint64_t i = 0; i < count && rc == 0; i++) {
+        uint64_t len;
+        if (read_full(fd, &len, sizeof(len)) == -1) {
+            rc = -1;
+            break;
+        }
+        if (len > cap) {
+            char *grown = realloc(buf, len);
+            if (!grown) {
+                rc = -1;
+                break;
+            }
+            buf = grown;
+            cap = len;
+        }
+        rc = read_full(fd, buf, len);
+        if (rc == 0) {
+            rc = history_add(buf, len, false);
+        }
+    }
+
+    uint64_t partial_len;
+    if (rc == 0 && read_full(fd, &partial_len, sizeof(partial_len)) == -1) {
+        rc = -1;
+    }
+    if (rc == 0 && partial_len) {
+        char *partial = malloc(partial_len);
+        if (!partial || read_full(fd, partial, partial_len) == -1) {
+            free(partial);
+            rc = -1;
+        } else {
+            pthread_mutex_lock(&history_mutex);
+            free(held);
+            held = partial;
+            held_len = held_cap = partial_len;
+            pthread_mutex_unlock(&history_mutex);
+        }
+    }
+    free(buf);
+    return rc;
+}
+
+void history_trim(size_t keep) {
+    pthread_mutex_lock(&history_mutex);
+    // Entries line up with the window's, so this stops exactly at its start
+    while (head && total_len > keep) {
+        evict_oldest();
+        generation++;
+    }
+    pthread_mutex_unlock(&history_mutex);
+}
+
+void history_destroy(void) {
+    pthread_mutex_lock(&history_mutex);
+    while (head) {
+        struct history_chunk *next = head->next;
+        chunk_put(head);
+        head = next;
+    }
+    tail = NULL;
+    chunk_count = 0;
+    total_len = 0;
+    free(held);
+    held = NULL;
+    held_len = held_cap = 0;
+    pthread_mutex_unlock(&history_mutex);
+}
@@ -0,0 +1,186 @@
+/***********************************************************************
+* @file  local.c
+* @version 1
+* @brief  AF_UNIX listener (-U) and sealed memfd appends for local producers
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*   1 memfd_map()/memfd_unmap(), so event loops can append a memfd asynchronously
+*
+* Producers on the same host can connect to the -U socket path instead of
+* TCP port 9000. Such a connection speaks the same text and binary protocol
+* and is served by the same loops as a TCP client, without the loopback
+* TCP stack in between.
+*
+* Every client socket is read with recvmsg(), so a local producer may also
+* pass descriptors with SCM_RIGHTS. Each connection keeps up to
+* PASSED_FDS_MAX of them, oldest first. An AESD_MEMFD line, or an
+* AESD_OP_MEMFD frame, consumes the oldest one. It must be a memfd sealed
+* against writes and shrinking, holding whole lines. Its contents are
+* mapped read-only and handed to the writer as a single append, so the
+* bytes are neither framed nor copied before the backend's own write. The
+* reply is the same as for one line: the history echo, or an append ack.
+*
+* The listener is handed to a successor on a hot upgrade like the TCP ones.
+* The socket file is removed when the server exits, but not when it hands
+* over.
+*
+*Ref:
+* 1. unix(7) SCM_RIGHTS, cmsg(3), memfd_create(2), fcntl(2) F_GET_SEALS
+*/
+
+#define _GNU_SOURCE  // MSG_CMSG_CLOEXEC, F_GET_SEALS
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "aesdsocket.h"
+
+// A memfd with these seals can neither change under the mapping nor SIGBUS it
+#define MEMFD_SEALS (F_SEAL_WRITE | F_SEAL_SHRINK)
+
+int local_fd = -1;
+static const char *local_path;
+
+int local_listener(const char *path) {
+    // A predecessor's listener is already bound, and may have clients queued
+    int fd = handoff_take_local_listener();
+    if (fd == -1) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) {
+            syslog(LOG_ERR, "Failed to create local socket: %s", strerror(errno));
+            return -1;
+        }
+        // A socket file left by a server that did not exit cleanly blocks bind()
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(path);
+        }
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            syslog(LOG_ERR, "Failed to bind local socket %s: %s", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        if (listen(fd, config.backlog) == -1) {
+            syslog(LOG_ERR, "Failed to listen on local socket: %s", strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    local_path = path;
+    handoff_add_listener(fd);
+    return fd;
+}
+
+void local_close(bool handing_off) {
+    if (local_fd == -1) {
+        return;
+    }
+    close(local_fd);
+    local_fd = -1;
+    // A successor keeps serving on the same path
+    if (!handing_off) {
+        unlink(local_path);
+    }
+}
+
+// Keep descriptors passed with SCM_RIGHTS for later AESD_MEMFD requests
+static void keep_passed_fds(struct reply_sink *sink, struct msghdr *msg) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (sink->passed_count < PASSED_FDS_MAX) {
+                sink->passed_fds[sink->passed_count++] = fd;
+            } else {
+                aesd_log_ratelimited(LOG_ERR, "Too many passed descriptors, closing one");
+                close(fd);
+            }
+        }
+    }
+}
+
+ssize_t recv_client(int fd, char *buf, size_t len, struct reply_sink *sink) {
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * PASSED_FDS_MAX)];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    // Passed descriptors must not leak into a hot-upgraded successor
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n > 0 && msg.msg_controllen > 0) {
+        keep_passed_fds(sink, &msg);
+    }
+    return n;
+}
+
+void passed_fds_release(struct reply_sink *sink) {
+    for (unsigned i = 0; i < sink->passed_count; i++) {
+        close(sink->passed_fds[i]);
+    }
+    sink->passed_count = 0;
+}
+
+const char *memfd_map(struct reply_sink *sink, size_t *len) {
+    if (sink->passed_count == 0) {
+        aesd_log_ratelimited(LOG_ERR, "AESD_MEMFD without a passed descriptor");
+        return NULL;
+    }
+    int fd = sink->passed_fds[0];
+    sink->passed_count--;
+    memmove(sink->passed_fds, sink->passed_fds + 1, sink->passed_count * sizeof(int));
+
+    const char *data = NULL;
+    int seals = fcntl(fd, F_GET_SEALS);
+    struct stat st;
+    if (seals == -1 || (seals & MEMFD_SEALS) != MEMFD_SEALS) {
+        aesd_log_ratelimited(LOG_ERR, "Passed descriptor is not a write and shrink sealed memfd");
+    } else if (fstat(fd, &st) == -1 || st.st_size == 0 || st.st_size > MEMFD_APPEND_MAX) {
+        aesd_log_ratelimited(LOG_ERR, "Passed memfd is empty or too large");
+    } else {
+        // The mapping outlives the descriptor
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to map passed memfd: %s", strerror(errno));
+            data = NULL;
+        } else if (data[st.st_size - 1] != '\n') {
+            aesd_log_ratelimited(LOG_ERR, "Passed memfd does not end with a newline");
+            munmap((void *)data, st.st_size);
+            data = NULL;
+        } else {
+            *len = st.st_size;
+            stats_add(STAT_BYTES_IN, st.st_size);
+        }
+    }
+    close(fd);
+    return data;
+}
+
+void memfd_unmap(const char *data, size_t len) {
+    munmap((void *)data, len);
+}
@@ -0,0 +1,216 @@
+/***********************************************************************
+* @file  log.c
+* @version 1
+* @brief  Asynchronous logger for aesdsocket request paths
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*   1 Flush to syslog() without holding rings_mutex
+*
+* syslog() takes a lock and writes to a socket on every call, which a storm
+* of failing clients turns into a convoy. With this logger a request thread
+* only formats the message into its own single-producer ring and publishes
+* it with a release store. A flusher thread drains every ring to syslog()
+* every LOG_FLUSH_MS. A full ring drops the message and counts it, so
+* logging never waits. Rings are recycled when their thread exits, as the
+* stats shards are.
+*
+* aesd_log() calls above AESD_LOG_LEVEL are compiled out. aesd_log_ratelimited()
+* additionally allows LOG_BURST messages per call site per second, and then
+* reports how many it held back.
+*
+* Before log_start() and after log_stop() messages go straight to syslog().
+*/
+
+#define _GNU_SOURCE  // vsyslog(), CLOCK_MONOTONIC_COARSE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <errno.h>
+#include <syslog.h>
+#include "aesdsocket.h"
+
+#define LOG_RING_SLOTS 64     // Messages buffered per thread (power of 2)
+#define LOG_MSG_SIZE 240
+#define LOG_FLUSH_MS 100
+#define LOG_BURST 10          // Rate limited messages per call site per second
+
+struct log_entry {
+    int level;
+    char msg[LOG_MSG_SIZE];
+};
+
+struct log_ring {
+    struct log_ring *next;
+    bool in_use;
+    unsigned head;            // Next slot the flusher reads
+    unsigned tail;            // Next slot the owner writes
+    unsigned long dropped;    // Written by the owner only
+    unsigned long dropped_reported;  // Read side copy, flusher only
+    struct log_entry slots[LOG_RING_SLOTS];
+};
+
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *rings;
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static __thread struct log_ring *my_ring;
+static pthread_t flusher_id;
+static bool flusher_running;      // Set and cleared by the main thread only
+static volatile bool log_async;   // Producers queue instead of calling syslog()
+static volatile bool flusher_stopping;
+
+static void ring_release(void *arg) {
+    struct log_ring *ring = arg;
+    pthread_mutex_lock(&rings_mutex);
+    ring->in_use = false;
+    pthread_mutex_unlock(&rings_mutex);
+}
+
+static void ring_key_create(void) {
+    pthread_key_create(&ring_key, ring_release);
+}
+
+static struct log_ring *ring_get(void) {
+    if (my_ring) {
+        return my_ring;
+    }
+    pthread_once(&ring_key_once, ring_key_create);
+
+    pthread_mutex_lock(&rings_mutex);
+    struct log_ring *ring;
+    for (ring = rings; ring && ring->in_use; ring = ring->next) {
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring));
+        if (ring) {
+            ring->next = rings;
+            rings = ring;
+        }
+    }
+    if (ring) {
+        ring->in_use = true;
+    }
+    pthread_mutex_unlock(&rings_mutex);
+
+    if (ring) {
+        pthread_setspecific(ring_key, ring);
+        my_ring = ring;
+    }
+    return ring;
+}
+
+static void log_vwrite(int level, const char *fmt, va_list ap) {
+    struct log_ring *ring = log_async ? ring_get() : NULL;
+    if (!ring) {
+        vsyslog(level, fmt, ap);
+        return;
+    }
+
+    unsigned tail = ring->tail;
+    unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail - head == LOG_RING_SLOTS) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    struct log_entry *entry = &ring->slots[tail % LOG_RING_SLOTS];
+    entry->level = level;
+    vsnprintf(entry->msg, sizeof(entry->msg), fmt, ap);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+void log_write(int level, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_vwrite(level, fmt, ap);
+    va_end(ap);
+}
+
+bool log_ratelimit(struct log_ratelimit *rl, unsigned *suppressed) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    long second = ts.tv_sec;
+
+    *suppressed = 0;
+    long window = __atomic_load_n(&rl->window, __ATOMIC_RELAXED);
+    if (window != second &&
+        __atomic_compare_exchange_n(&rl->window, &window, second, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+        *suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+    }
+    if (__atomic_add_fetch(&rl->count, 1, __ATOMIC_RELAXED) <= LOG_BURST) {
+        return true;
+    }
+    __atomic_add_fetch(&rl->suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+}
+
+// Hand everything queued so far to syslog()
+static void flush_rings(void) {
+    // Rings are never freed and new ones go in front, so the list from this
+    // head stays valid after unlocking. syslog() can block, and holding the
+    // mutex through it would stall threads logging for the first time.
+    pthread_mutex_lock(&rings_mutex);
+    struct log_ring *first = rings;
+    pthread_mutex_unlock(&rings_mutex);
+
+    for (struct log_ring *ring = first; ring; ring = ring->next) {
+        unsigned head = ring->head;
+        unsigned tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct log_entry *entry = &ring->slots[head % LOG_RING_SLOTS];
+            syslog(entry->level, "%s", entry->msg);
+            head++;
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+        unsigned long dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_reported) {
+            syslog(LOG_WARNING, "Log ring full, dropped %lu message(s)",
+                   dropped - ring->dropped_reported);
+            ring->dropped_reported = dropped;
+        }
+    }
+}
+
+static void *flusher_thread(void *arg) {
+    (void)arg;
+    struct timespec interval = { .tv_sec = 0, .tv_nsec = LOG_FLUSH_MS * 1000000L };
+    while (!flusher_stopping) {
+        nanosleep(&interval, NULL);
+        flush_rings();
+    }
+    return NULL;
+}
+
+int log_start(void) {
+    if (pthread_create(&flusher_id, NULL, flusher_thread, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to create log flusher thread");
+        return -1;
+    }
+    flusher_running = true;
+    log_async = true;
+    return 0;
+}
+
+// Flush what is queued and go back to calling syslog() directly
+void log_stop(void) {
+    if (!flusher_running) {
+        return;
+    }
+    log_async = false;
+    flusher_stopping = true;
+    pthread_join(flusher_id, NULL);
+    flusher_running = false;
+    flush_rings();
+}
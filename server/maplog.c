@@ -0,0 +1,169 @@
+/***********************************************************************
+* @file  maplog.c
+* @version 1
+* @brief  Memory mapped append log for the DATA_FILE backend (-S mmap)
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*   1 Not offered with -R, whose punched segments still use up the reservation
+*
+* At open, a range of address space is reserved once with PROT_NONE. The
+* file then grows MAPLOG_EXTENT bytes at a time: each extent is preallocated
+* with fallocate() and mapped MAP_FIXED over the next part of the
+* reservation. The log never moves, so readers may keep pointers into it
+* without any lock.
+*
+* The writer thread is the only appender. It copies a whole batch in with
+* memcpy() and then publishes the new length with a release store. A reader
+* loads the length with acquire and may send anything below it straight
+* from the mapping, because those bytes never change again. Replies
+* therefore need no read() or pread(). Each one costs the socket send and
+* nothing else.
+*
+* Offsets are absolute and never reused, so the log holds MAPLOG_RESERVE
+* bytes over its whole life. Retention (-R) frees disk blocks, not address
+* space, so it is refused with this backend.
+*
+* While the server runs, the file is padded with zeros up to the end of the
+* last extent. maplog_close() trims it back to the logged length, which is
+* also where a hot-upgraded successor expects it.
+*
+*Ref:
+* 1. mmap(2), fallocate(2) man pages
+*/
+
+#define _GNU_SOURCE  // fallocate(), MAP_NORESERVE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "aesdsocket.h"
+
+#define MAPLOG_EXTENT (16UL * 1024 * 1024)  // File growth step, a multiple of the page size
+#if UINTPTR_MAX > 0xffffffffUL
+#define MAPLOG_RESERVE (64ULL << 30)        // Largest log; address space only
+#else
+#define MAPLOG_RESERVE (512UL << 20)
+#endif
+
+static int maplog_fd = -1;
+static char *maplog_base;         // Start of the reservation, NULL when closed
+static size_t maplog_mapped;      // Bytes of file mapped at maplog_base
+static size_t maplog_len;         // Published length, see maplog_length()
+
+// Preallocate and map extents until at least need bytes are mapped
+static int maplog_grow(size_t need) {
+    while (maplog_mapped < need) {
+        if (maplog_mapped + MAPLOG_EXTENT > MAPLOG_RESERVE) {
+            errno = ENOSPC;
+            return -1;
+        }
+        // Allocated blocks, so a store into the mapping cannot SIGBUS on a full disk
+        if (fallocate(maplog_fd, 0, maplog_mapped, MAPLOG_EXTENT) == -1) {
+            if (errno != EOPNOTSUPP) {
+                return -1;
+            }
+            int rc = posix_fallocate(maplog_fd, maplog_mapped, MAPLOG_EXTENT);
+            if (rc != 0) {
+                errno = rc;
+                return -1;
+            }
+        }
+        void *extent = mmap(maplog_base + maplog_mapped, MAPLOG_EXTENT, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_FIXED, maplog_fd, maplog_mapped);
+        if (extent == MAP_FAILED) {
+            return -1;
+        }
+        maplog_mapped += MAPLOG_EXTENT;
+    }
+    return 0;
+}
+
+int maplog_open(const char *path) {
+    maplog_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (maplog_fd == -1) {
+        syslog(LOG_ERR, "Failed to open data file: %s", strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(maplog_fd, &st) == -1) {
+        syslog(LOG_ERR, "Failed to stat data file: %s", strerror(errno));
+        maplog_close();
+        return -1;
+    }
+
+    void *base = mmap(NULL, MAPLOG_RESERVE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) {
+        syslog(LOG_ERR, "Failed to reserve the data file mapping: %s", strerror(errno));
+        maplog_close();
+        return -1;
+    }
+    maplog_base = base;
+
+    // Whatever the file already holds, e.g. after a hot upgrade, is history
+    if (maplog_grow(st.st_size > 0 ? (size_t)st.st_size : 1) == -1) {
+        syslog(LOG_ERR, "Failed to map data file: %s", strerror(errno));
+        maplog_close();
+        return -1;
+    }
+    maplog_len = st.st_size;
+    return 0;
+}
+
+size_t maplog_append_batch(const struct append_req *batch) {
+    size_t len = maplog_len;
+    size_t total = len;
+    size_t count = 0;
+    for (const struct append_req *req = batch; req; req = req->next) {
+        total += req->len;
+        count++;
+    }
+    if (maplog_grow(total) == -1) {
+        aesd_log_ratelimited(LOG_ERR, "Failed to grow data file: %s", strerror(errno));
+        return 0;
+    }
+    for (const struct append_req *req = batch; req; req = req->next) {
+        memcpy(maplog_base + len, req->data, req->len);
+        len += req->len;
+    }
+    // Readers see the whole batch or none of it
+    __atomic_store_n(&maplog_len, len, __ATOMIC_RELEASE);
+    return count;
+}
+
+size_t maplog_length(void) {
+    return __atomic_load_n(&maplog_len, __ATOMIC_ACQUIRE);
+}
+
+const char *maplog_data(void) {
+    return maplog_base;
+}
+
+// Trim the padding and unmap; safe if never opened
+void maplog_close(void) {
+    if (maplog_fd != -1 && maplog_base && ftruncate(maplog_fd, maplog_len) == -1) {
+        syslog(LOG_ERR, "Failed to trim data file: %s", strerror(errno));
+    }
+    if (maplog_base) {
+        munmap(maplog_base, MAPLOG_RESERVE);
+        maplog_base = NULL;
+    }
+    maplog_mapped = 0;
+    maplog_len = 0;
+    if (maplog_fd != -1) {
+        close(maplog_fd);
+        maplog_fd = -1;
+    }
+}
@@ -0,0 +1,171 @@
+/***********************************************************************
+* @file  pool.c
+* @version 2
+* @brief  Pre-spawned worker pool for aesdsocket
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*   1 Let in-flight clients finish before a hot upgrade
+*   2 Each worker serves its clients from its own buffer arena
+*
+* The main thread only accepts and pushes client descriptors into a bounded
+* ring; a fixed number of workers created at startup pop them and serve each
+* client with the same blocking handler as thread mode. When the ring is full
+* accept stalls, which leaves further clients waiting in the listen backlog
+* instead of growing the process. The accept loop also writes the periodic
+* timestamp lines.
+*
+* An AESD_SUBSCRIBE client keeps its worker for as long as it stays
+* subscribed, so size -t for the expected subscribers plus request traffic.
+*/
+
+#define _POSIX_C_SOURCE 200112L  // Enable POSIX features
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+
+#define POOL_QUEUE_DEPTH 256            // Accepted clients waiting for a worker
+#define POOL_WORKER_STACK (256 * 1024)  // Handlers need a few KB of stack
+#define POOL_ARENA_BUFFERS 4            // Receive, partial line and snapshot, plus one spare
+
+static int queue_fds[POOL_QUEUE_DEPTH];
+static size_t queue_head, queue_count;
+static bool queue_closed;
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+
+// Hand an accepted client to the pool, blocking while the queue is full
+static int queue_push(int client_fd) {
+    pthread_mutex_lock(&queue_mutex);
+    while (queue_count == POOL_QUEUE_DEPTH && !queue_closed) {
+        pthread_cond_wait(&queue_not_full, &queue_mutex);
+    }
+    if (queue_closed) {
+        pthread_mutex_unlock(&queue_mutex);
+        return -1;
+    }
+    queue_fds[(queue_head + queue_count) % POOL_QUEUE_DEPTH] = client_fd;
+    queue_count++;
+    pthread_cond_signal(&queue_not_empty);
+    pthread_mutex_unlock(&queue_mutex);
+    return 0;
+}
+
+// Take the next client, or -1 once the queue is closed and empty
+static int queue_pop(void) {
+    pthread_mutex_lock(&queue_mutex);
+    while (queue_count == 0 && !queue_closed) {
+        pthread_cond_wait(&queue_not_empty, &queue_mutex);
+    }
+    int client_fd = -1;
+    if (queue_count > 0) {
+        client_fd = queue_fds[queue_head];
+        queue_head = (queue_head + 1) % POOL_QUEUE_DEPTH;
+        queue_count--;
+        pthread_cond_signal(&queue_not_full);
+    }
+    pthread_mutex_unlock(&queue_mutex);
+    return client_fd;
+}
+
+static void queue_close(void) {
+    pthread_mutex_lock(&queue_mutex);
+    queue_closed = true;
+    pthread_cond_broadcast(&queue_not_empty);
+    pthread_cond_broadcast(&queue_not_full);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+static void *pool_worker(void *arg) {
+    (void)arg;
+    // One client at a time, so a few buffers cover everything it needs
+    struct buf_arena arena;
+    size_t count = config.arena_buffers < POOL_ARENA_BUFFERS ? config.arena_buffers
+                                                             : POOL_ARENA_BUFFERS;
+    bool have_arena = arena_init(&arena, count, config.arena_buf_size) == 0;
+
+    int client_fd;
+    while ((client_fd = queue_pop()) != -1) {
+        struct conn_slot *slot = registry_add(client_fd);
+        if (!slot) {
+            close(client_fd);
+            continue;
+        }
+        serve_client(client_fd, have_arena ? &arena : NULL);
+        registry_remove(slot);  // Closes client_fd
+    }
+    if (have_arena) {
+        arena_destroy(&arena);
+    }
+    return NULL;
+}
+
+int run_pool(int timer_fd) {
+    int nworkers = config.io_threads;
+    if (nworkers <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nworkers = ncpu > 0 ? (int)ncpu * 4 : 4;
+    }
+
+    pthread_t *workers = calloc(nworkers, sizeof(*workers));
+    if (!workers) {
+        syslog(LOG_ERR, "Failed to allocate worker pool");
+        return -1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, POOL_WORKER_STACK);
+
+    int rc = 0;
+    int started = 0;
+    for (; started < nworkers; started++) {
+        if (pthread_create(&workers[started], &attr, pool_worker, NULL) != 0) {
+            syslog(LOG_ERR, "Failed to create worker thread");
+            rc = -1;
+            break;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    syslog(LOG_INFO, "Worker pool running with %d thread(s)", started);
+
+    while (!stop_flag && rc == 0) {
+        uint64_t accept_start;
+        int new_fd = accept_client(timer_fd, &accept_start);
+        if (new_fd == -1) {
+            break;
+        }
+        // Includes any time spent waiting for room in the queue
+        if (queue_push(new_fd) == -1) {
+            close(new_fd);
+            continue;
+        }
+        stats_record(STAT_ACCEPT, accept_start);
+    }
+
+    // Unblock the clients being served, then stop the workers. Before a hot
+    // upgrade they first get a moment to finish what they are doing.
+    queue_close();
+    if (handoff_pending()) {
+        registry_drain(HANDOFF_DRAIN_MS);
+    }
+    registry_shutdown_all();
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    registry_destroy();
+    free(workers);
+    return rc;
+}
@@ -0,0 +1,916 @@
+/***********************************************************************
+* @file  reactor.c
+* @version 8
+* @brief  Edge-triggered epoll reactor for aesdsocket
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*   1 Shard mode: one SO_REUSEPORT listener per reactor, threads pinned per CPU
+*   2 AESD_SUBSCRIBE clients are fed from the broadcast ring
+*   3 Shard listeners are handed over on a hot upgrade
+*   4 Reply sinks no longer carry a splice() pipe
+*   5 Per-reactor buffer arena and recycled connection objects
+*   6 Deficit round robin across a reactor's connections (-F)
+*   7 The -U listener is shared by every reactor like the TCP one
+*   8 Appends complete asynchronously; the writer's callback wakes the reactor
+*
+* A fixed set of I/O threads each own an epoll instance. The listening socket
+* is registered with every instance using EPOLLEXCLUSIVE so only one thread is
+* woken per incoming connection, and the accepting thread keeps the client for
+* its lifetime. A -U listener is registered the same way, in shard mode too.
+* Client sockets are non-blocking and edge-triggered; replies are queued per
+* connection and flushed as the socket becomes writable. Reactor 0 also owns
+* the timestamp timerfd.
+*
+* A reactor never waits for the group commit writer. An append is copied
+* into an arena buffer (a memfd stays mapped) and queued with
+* writer_submit(). The connection then pauses at that message boundary,
+* its remaining input held as for a -F yield, while the reactor serves
+* everyone else. Each of its connections can have a line in the same batch.
+* The writer's callback pushes the finished request onto the reactor's
+* lock-free done stack and writes its eventfd only if the stack was empty.
+* The reactor then queues the reply and resumes the connection. Timestamps
+* are submitted the same way.
+*
+* In shard mode (-m shard) each reactor instead gets its own SO_REUSEPORT
+* listener. The kernel hashes incoming connections across them, so accepts
+* never contend on a shared queue, and each thread is pinned to its own CPU.
+*
+* Each reactor owns a buffer arena (see arena.c). It receives into one
+* arena buffer, and a connection draws a reply or partial line buffer from
+* it only while it has one pending. Closed connections are kept on a spare
+* list for the next accept, so serving steady traffic allocates nothing.
+*
+* With -F, each connection is given a quantum of bytes per round, picked by
+* its source address, and the reactor schedules them by deficit round robin.
+* A round is one pass of the event loop. Each line a connection sends is
+* charged against its deficit, and so is the reply queued for it, so a
+* full-history echo costs as much as the history is long. A connection that
+* runs out stops at that message boundary: the framer yields, the rest of
+* its input is held in an arena buffer, and it waits on the run queue for
+* the next round's quantum. An echo bigger than the quantum leaves the
+* connection in debt, and it sits out rounds until it has paid it back.
+* Clients that stay within their quantum are served as soon as their events
+* arrive, ahead of anyone still waiting. Rounds in which every waiting
+* connection would still be in debt are skipped while nothing else is
+* ready, so a lone heavy client still gets the whole reactor.
+*
+* A reactor that gets its first subscriber registers an eventfd with the
+* broadcast ring. Each publish then costs the writer one write() per
+* reactor, not per subscriber. The reactor sends each of its subscribers
+* what is new from the shared ring. A subscriber whose socket is full waits
+* for EPOLLOUT while the ring moves on without it.
+*
+*Ref:
+* 1. epoll(7), timerfd_create(2), eventfd(2) man pages
+* 2. socket(7) SO_REUSEPORT, pthread_attr_setaffinity_np(3)
+*/
+
+#define _GNU_SOURCE  // Enable POSIX features plus CPU affinity
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include "queue.h"
+#include "aesdsocket.h"
+
+#define MAX_EVENTS 64  // Events handled per epoll_wait call
+#define REACTOR_SPARE_CONNS 64  // Closed connections kept for reuse per reactor
+
+struct reactor;
+
+// State for one client connection owned by a reactor thread
+struct reactor_conn {
+    int fd;
+    struct reactor *owner;
+    struct line_framer framer;
+    struct reply_sink sink;  // Keeps the data fd open for the connection's lifetime
+    char *out_buf;         // Replies not yet accepted by the socket
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    char *held;            // Input received but left unframed by a yield
+    size_t held_len;
+    size_t held_off;
+    uint64_t quantum;      // -F bytes per round, 0 when unthrottled
+    int64_t deficit;       // Bytes left this round, negative while in debt
+    bool in_pending;       // Unread input left behind while output was backed up
+    bool subscriber;       // On the owner's subscriber list
+    bool shut_down;        // Failed outside its own event, closed by its next one
+    bool scheduled;        // On the owner's run queue
+    bool appending;        // append is with the writer; input waits for it
+    bool closed;           // Closed while appending, released once it completes
+    int append_op;         // What to reply with, see append_reply()
+    bool append_mapped;    // append.data is a memfd mapping, not an arena copy
+    uint64_t append_start;
+    struct append_req append;
+    LIST_ENTRY(reactor_conn) entries;
+    LIST_ENTRY(reactor_conn) sub_entries;
+    TAILQ_ENTRY(reactor_conn) run_entries;
+};
+
+LIST_HEAD(reactor_conn_list, reactor_conn);
+TAILQ_HEAD(reactor_run_queue, reactor_conn);
+
+struct reactor {
+    pthread_t thread;
+    int epfd;
+    int listen_fd;         // sockfd, or this shard's own SO_REUSEPORT listener
+    int timer_fd;          // Only valid on reactor 0
+    int broadcast_fd;      // eventfd written on publish, -1 until a client subscribes
+    struct reactor_conn_list conns;
+    struct reactor_conn_list subscribers;
+    struct reactor_conn_list spare;  // Closed connections ready for reuse
+    struct reactor_run_queue run;    // Waiting for their next DRR quantum
+    int done_fd;           // eventfd written when done goes from empty to not
+    struct append_req *done;         // Appends committed by the writer, newest first
+    unsigned appends_inflight;
+    struct append_req stamp;         // Reactor 0's timestamp line, if in flight
+    char stamp_buf[128];
+    bool stamp_inflight;
+    int spare_count;
+    struct buf_arena arena;
+    char *recv_buf;        // Shared by all of this reactor's connections
+    size_t recv_size;
+};
+
+// Tags stored in epoll_event.data.ptr for the non-client descriptors
+static char listener_tag, local_tag, timer_tag, wake_tag, broadcast_tag, done_tag;
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// The -F quantum for a client: its longest matching rule, else the default.
+// Local clients have no address and always get the default.
+static uint64_t fair_quantum(const struct sockaddr_storage *peer) {
+    const struct fair_config *fair = &config.fair;
+    const struct fair_rule *best = NULL;
+    const struct sockaddr_in *in = (const struct sockaddr_in *)peer;
+    for (size_t i = 0; i < fair->rule_count && peer->ss_family == AF_INET; i++) {
+        const struct fair_rule *rule = &fair->rules[i];
+        if ((in->sin_addr.s_addr & rule->mask) == rule->addr &&
+            (!best || rule->prefix > best->prefix)) {
+            best = rule;
+        }
+    }
+    return best ? best->quantum : fair->quantum;
+}
+
+// Charge ingested or echoed bytes against a throttled connection's deficit
+static inline void conn_charge(struct reactor_conn *conn, size_t bytes) {
+    if (conn->quantum) {
+        conn->deficit -= (int64_t)bytes;
+    }
+}
+
+// Put a connection that is out of quota at the back of the run queue
+static void conn_schedule(struct reactor_conn *conn) {
+    if (!conn->scheduled) {
+        TAILQ_INSERT_TAIL(&conn->owner->run, conn, run_entries);
+        conn->scheduled = true;
+        stats_add(STAT_FAIR_DEFERRALS, 1);
+    }
+}
+
+// reply_fn that queues bytes on the connection for a later non-blocking flush
+static int conn_queue_reply(void *ctx, const char *buf, size_t len) {
+    struct reactor_conn *conn = ctx;
+    if (conn->out_len + len > conn->out_cap) {
+        size_t new_cap = conn->out_cap ? conn->out_cap : BUF_SIZE;
+        while (new_cap < conn->out_len + len) {
+            new_cap *= 2;
+        }
+        char *new_buf = arena_alloc(&conn->owner->arena, new_cap, &new_cap);
+        if (!new_buf) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to grow reply buffer");
+            return -1;
+        }
+        if (conn->out_len > 0) {
+            memcpy(new_buf, conn->out_buf, conn->out_len);
+        }
+        arena_free(&conn->owner->arena, conn->out_buf);
+        conn->out_buf = new_buf;
+        conn->out_cap = new_cap;
+    }
+    memcpy(conn->out_buf + conn->out_len, buf, len);
+    conn->out_len += len;
+    conn_charge(conn, len);
+    return 0;
+}
+
+// message_fn for reactor connections: replies are queued, not sent inline
+static void conn_on_message(void *ctx, int op, const char *msg, size_t len) {
+    struct reactor_conn *conn = ctx;
+    conn_charge(conn, len);
+    process_request(op, msg, len, &conn->sink);
+    // The rest waits for the commit, or for a later round
+    if (conn->appending || (conn->quantum && conn->deficit <= 0)) {
+        conn->framer.yield = true;
+    }
+}
+
+// Writer thread: hand a committed append back to the reactor that submitted it
+static void reactor_push_done(struct reactor *r, struct append_req *req) {
+    struct append_req *head = __atomic_load_n(&r->done, __ATOMIC_RELAXED);
+    do {
+        req->next = head;
+    } while (!__atomic_compare_exchange_n(&r->done, &head, req, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    uint64_t one = 1;
+    if (!head && write(r->done_fd, &one, sizeof(one)) == -1) {
+        aesd_log_ratelimited(LOG_ERR, "Failed to wake reactor: %s", strerror(errno));
+    }
+}
+
+// on_done for a connection's append; the connection stays put until it is back
+static void conn_append_done(struct append_req *req) {
+    struct reactor_conn *conn = req->ctx;
+    reactor_push_done(conn->owner, req);
+}
+
+// on_done for reactor 0's timestamp line
+static void reactor_stamp_done(struct append_req *req) {
+    reactor_push_done(req->ctx, req);
+}
+
+// sink->submit for reactor connections: queue the append and return
+static int conn_submit(void *ctx, int op, const char *data, size_t len, bool mapped) {
+    struct reactor_conn *conn = ctx;
+    struct reactor *r = conn->owner;
+    const char *copy = data;
+    if (!mapped) {
+        // data points into a receive or framer buffer that is about to be reused
+        size_t cap;
+        char *buf = arena_alloc(&r->arena, len, &cap);
+        if (!buf) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to copy append");
+            return -1;
+        }
+        memcpy(buf, data, len);
+        copy = buf;
+    }
+    conn->append = (struct append_req) {
+        .data = copy,
+        .len = len,
+        .on_done = conn_append_done,
+        .ctx = conn,
+    };
+    conn->append_op = op;
+    conn->append_mapped = mapped;
+    conn->append_start = stats_now();
+    conn->appending = true;
+    r->appends_inflight++;
+    writer_submit(&conn->append);
+    return 0;
+}
+
+// Return a closed connection's buffers and keep it for the next accept
+static void conn_release(struct reactor_conn *conn) {
+    struct reactor *r = conn->owner;
+    arena_free(&r->arena, conn->out_buf);
+    arena_free(&r->arena, conn->held);
+    framer_free(&conn->framer);
+    reply_sink_release(&conn->sink);
+    if (r->spare_count < REACTOR_SPARE_CONNS) {
+        LIST_INSERT_HEAD(&r->spare, conn, entries);
+        r->spare_count++;
+    } else {
+        free(conn);
+    }
+}
+
+static void conn_close(struct reactor_conn *conn) {
+    LIST_REMOVE(conn, entries);
+    if (conn->subscriber) {
+        LIST_REMOVE(conn, sub_entries);
+    }
+    if (conn->scheduled) {
+        TAILQ_REMOVE(&conn->owner->run, conn, run_entries);
+    }
+    close(conn->fd);  // Also removes it from the epoll set
+    stats_conn_close();
+    // The writer still holds its append; the completion releases it
+    if (conn->appending) {
+        conn->closed = true;
+        return;
+    }
+    conn_release(conn);
+}
+
+// Push queued replies to the socket; returns -1 if the connection failed
+static int conn_flush(struct reactor_conn *conn) {
+    while (conn->out_sent < conn->out_len) {
+        ssize_t sent_now = send(conn->fd, conn->out_buf + conn->out_sent,
+                                conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        if (sent_now == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            aesd_log_ratelimited(LOG_ERR, "Send failed: %s", strerror(errno));
+            return -1;
+        }
+        conn->out_sent += sent_now;
+        stats_add(STAT_BYTES_OUT, sent_now);
+    }
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    // Idle connections hold no arena buffer
+    if (arena_owns(&conn->owner->arena, conn->out_buf)) {
+        arena_free(&conn->owner->arena, conn->out_buf);
+        conn->out_buf = NULL;
+        conn->out_cap = 0;
+    }
+    return 0;
+}
+
+static int reactor_add(struct reactor *r, int fd, uint32_t events, void *tag);
+
+// Send a subscriber what the ring has past its cursor; -1 if it must be closed
+static int conn_push(struct reactor_conn *conn) {
+    if (conn->shut_down) {
+        return -1;
+    }
+    return broadcast_send(conn->fd, &conn->sink.tail, 0) == -1 ? -1 : 0;
+}
+
+// Move a connection that sent AESD_SUBSCRIBE onto its reactor's subscriber list
+static int conn_subscribe(struct reactor_conn *conn) {
+    struct reactor *r = conn->owner;
+    if (r->broadcast_fd == -1) {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd == -1) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to create eventfd: %s", strerror(errno));
+            return -1;
+        }
+        if (reactor_add(r, fd, EPOLLIN, &broadcast_tag) == -1 || broadcast_watch(fd) == -1) {
+            close(fd);
+            return -1;
+        }
+        r->broadcast_fd = fd;
+    }
+    conn->subscriber = true;
+    LIST_INSERT_HEAD(&r->subscribers, conn, sub_entries);
+    return 0;
+}
+
+// Frame input from buf, which is either the held input or the receive
+// buffer; a yield leaves the rest held. Returns -1 if the connection failed.
+static int conn_frame(struct reactor_conn *conn, const char *buf, size_t len) {
+    struct buf_arena *arena = &conn->owner->arena;
+    size_t used = framer_feed(&conn->framer, buf, len, conn_on_message, conn);
+    if (conn->held) {
+        conn->held_off += used;
+        if (conn->held_off == conn->held_len) {
+            arena_free(arena, conn->held);
+            conn->held = NULL;
+            conn->held_len = conn->held_off = 0;
+        }
+    } else if (used < len) {
+        size_t cap;
+        conn->held = arena_alloc(arena, len - used, &cap);
+        if (!conn->held) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to hold deferred input");
+            return -1;
+        }
+        memcpy(conn->held, buf + used, len - used);
+        conn->held_len = len - used;
+        conn->held_off = 0;
+    }
+    if (conn_flush(conn) == -1 ||
+        (conn->sink.subscribed && !conn->subscriber && conn_subscribe(conn) == -1)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Drain the socket until EAGAIN or the connection's quota runs out; returns
+// -1 if the connection was closed
+static int conn_on_readable(struct reactor_conn *conn) {
+    char *buf = conn->owner->recv_buf;
+    for (;;) {
+        // Requests are answered in order, so nothing more until the commit
+        if (conn->appending) {
+            conn->in_pending = true;
+            return 0;
+        }
+        // Stop reading while replies are backed up so a client that never
+        // reads cannot make us buffer its whole history over and over
+        if (conn->out_len > conn->out_sent) {
+            conn->in_pending = true;
+            return 0;
+        }
+        if (conn->quantum && conn->deficit <= 0) {
+            conn->in_pending = true;
+            conn_schedule(conn);
+            return 0;
+        }
+
+        // What an earlier yield left unframed goes before anything new
+        if (conn->held) {
+            if (conn_frame(conn, conn->held + conn->held_off,
+                           conn->held_len - conn->held_off) == -1) {
+                conn_close(conn);
+                return -1;
+            }
+            continue;
+        }
+
+        uint64_t recv_start = stats_now();
+        ssize_t bytes_received = recv_client(conn->fd, buf, conn->owner->recv_size, &conn->sink);
+        stats_record(STAT_RECV, recv_start);
+        if (bytes_received > 0) {
+            stats_add(STAT_BYTES_IN, bytes_received);
+            if (conn_frame(conn, buf, bytes_received) == -1) {
+                conn_close(conn);
+                return -1;
+            }
+            continue;
+        }
+        if (bytes_received == 0) {
+            aesd_log(LOG_INFO, "Client disconnected");
+            conn_close(conn);
+            return -1;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            conn->in_pending = false;
+            // An idle connection banks at most one quantum; debt stays
+            if (conn->deficit > 0) {
+                conn->deficit = conn->quantum;
+            }
+            return 0;
+        }
+        aesd_log_ratelimited(LOG_ERR, "recv() failed: %s", strerror(errno));
+        conn_close(conn);
+        return -1;
+    }
+}
+
+static void conn_on_writable(struct reactor_conn *conn) {
+    if (conn_flush(conn) == -1 || (conn->subscriber && conn_push(conn) == -1)) {
+        conn_close(conn);
+        return;
+    }
+    if (conn->out_len == 0 && conn->in_pending) {
+        conn_on_readable(conn);
+    }
+}
+
+// Reply to a connection's committed append and carry on with its input
+static void conn_append_finish(struct reactor_conn *conn) {
+    struct reactor *r = conn->owner;
+    struct append_req *req = &conn->append;
+    conn->appending = false;
+    r->appends_inflight--;
+    if (conn->append_mapped) {
+        memfd_unmap(req->data, req->len);
+    } else {
+        arena_free(&r->arena, (char *)req->data);
+    }
+    if (conn->closed) {
+        conn_release(conn);
+        return;
+    }
+    if (req->status == 0) {
+        stats_record(STAT_APPEND, conn->append_start);
+    }
+    append_reply(conn->append_op, req->status, req->end, &conn->sink);
+    if (conn_flush(conn) == -1) {
+        conn_close(conn);
+        return;
+    }
+    // Once stopping, only what was already submitted gets its reply
+    if (!stop_flag) {
+        conn_on_readable(conn);
+    }
+}
+
+// Take every append the writer has finished for this reactor
+static void reactor_on_done(struct reactor *r) {
+    uint64_t count;
+    if (read(r->done_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        aesd_log_ratelimited(LOG_ERR, "Failed to read reactor eventfd: %s", strerror(errno));
+    }
+    struct append_req *req = __atomic_exchange_n(&r->done, NULL, __ATOMIC_ACQUIRE);
+    while (req) {
+        struct append_req *next = req->next;
+        if (req == &r->stamp) {
+            r->stamp_inflight = false;
+            r->appends_inflight--;
+        } else {
+            conn_append_finish(req->ctx);
+        }
+        req = next;
+    }
+}
+
+// One DRR round: each connection on the run queue gets its quantum and is
+// served while that lasts. When nothing else is ready, rounds in which all
+// of them would still be in debt are skipped.
+static void reactor_round(struct reactor *r, bool idle) {
+    struct reactor_conn *conn;
+    uint64_t rounds = 1;
+    if (idle) {
+        rounds = UINT64_MAX;
+        TAILQ_FOREACH(conn, &r->run, run_entries) {
+            uint64_t need = conn->deficit < 0 ? (uint64_t)-conn->deficit / conn->quantum + 1 : 1;
+            if (need < rounds) {
+                rounds = need;
+            }
+        }
+    }
+
+    // Whoever runs out again goes behind the last one waiting now
+    struct reactor_conn *last = TAILQ_LAST(&r->run, reactor_run_queue);
+    bool done = false;
+    while (!done && (conn = TAILQ_FIRST(&r->run))) {
+        done = conn == last;
+        TAILQ_REMOVE(&r->run, conn, run_entries);
+        conn->scheduled = false;
+        conn->deficit += (int64_t)(rounds * conn->quantum);
+        if (conn->deficit > 0) {
+            conn_on_readable(conn);
+        } else {
+            conn_schedule(conn);
+        }
+    }
+}
+
+// Accept every pending connection on listen_fd and register it on this reactor
+static void reactor_accept(struct reactor *r, int listen_fd) {
+    // epoll just reported the listener readable. Connections after the first
+    // waited for those before them, which their STAT_ACCEPT includes.
+    uint64_t accept_start = stats_now();
+    for (;;) {
+        struct sockaddr_storage peer;
+        socklen_t peer_len = sizeof(peer);
+        int new_fd = accept(listen_fd, (struct sockaddr *)&peer, &peer_len);
+        if (new_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !stop_flag) {
+                aesd_log_ratelimited(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
+            }
+            return;
+        }
+
+        struct reactor_conn *conn = LIST_FIRST(&r->spare);
+        if (conn) {
+            LIST_REMOVE(conn, entries);
+            r->spare_count--;
+            memset(conn, 0, sizeof(*conn));
+        } else {
+            conn = calloc(1, sizeof(*conn));
+        }
+        if (!conn || set_nonblocking(new_fd) == -1) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to set up client connection");
+            free(conn);
+            close(new_fd);
+            continue;
+        }
+        conn->fd = new_fd;
+        conn->owner = r;
+        conn->quantum = fair_quantum(&peer);
+        conn->deficit = conn->quantum;
+        framer_init(&conn->framer, config.max_line_len, &r->arena);
+        // The socket is non-blocking, so replies are always copied into out_buf
+        conn->sink = (struct reply_sink) {
+            .write = conn_queue_reply,
+            .ctx = conn,
+            .sock_fd = -1,
+            .data_fd = -1,
+            .arena = &r->arena,
+            .snapshot = NULL,
+            .snapshot_cap = 0,
+            .submit = conn_submit,
+        };
+
+        struct epoll_event ev = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = conn,
+        };
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, new_fd, &ev) == -1) {
+            aesd_log_ratelimited(LOG_ERR, "epoll_ctl add client failed: %s", strerror(errno));
+            free(conn);
+            close(new_fd);
+            continue;
+        }
+        LIST_INSERT_HEAD(&r->conns, conn, entries);
+        stats_conn_open();
+        stats_record(STAT_ACCEPT, accept_start);
+    }
+}
+
+static void reactor_on_timer(struct reactor *r) {
+    // A late wakeup reports several expirations; one line covers them
+    uint64_t expirations;
+    if (read(r->timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    // Not even a timestamp makes the reactor wait for the writer. One that
+    // is still queued when the next fires covers both, as above.
+    if (r->stamp_inflight) {
+        return;
+    }
+    size_t len = format_timestamp(r->stamp_buf, sizeof(r->stamp_buf));
+    if (len == 0) {
+        return;
+    }
+    aesd_log(LOG_DEBUG, "Writing timestamp: %s", r->stamp_buf);
+    r->stamp = (struct append_req) {
+        .data = r->stamp_buf,
+        .len = len,
+        .on_done = reactor_stamp_done,
+        .ctx = r,
+    };
+    r->stamp_inflight = true;
+    r->appends_inflight++;
+    writer_submit(&r->stamp);
+}
+
+static void reactor_on_broadcast(struct reactor *r) {
+    uint64_t count;
+    if (read(r->broadcast_fd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+    struct reactor_conn *conn;
+    LIST_FOREACH(conn, &r->subscribers, sub_entries) {
+        if (!conn->shut_down && conn_push(conn) == -1) {
+            // Its own events may still be in this batch, so let them close it
+            conn->shut_down = true;
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+}
+
+static void *reactor_thread(void *arg) {
+    struct reactor *r = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!stop_flag) {
+        // Connections waiting for a quantum keep the loop from blocking
+        int n = epoll_wait(r->epfd, events, MAX_EVENTS, TAILQ_EMPTY(&r->run) ? -1 : 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            syslog(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+
+        bool appended = false;
+        for (int i = 0; i < n && !stop_flag; i++) {
+            void *tag = events[i].data.ptr;
+            uint32_t ev = events[i].events;
+
+            if (tag == &listener_tag) {
+                reactor_accept(r, r->listen_fd);
+            } else if (tag == &local_tag) {
+                reactor_accept(r, local_fd);
+            } else if (tag == &timer_tag) {
+                reactor_on_timer(r);
+            } else if (tag == &broadcast_tag) {
+                reactor_on_broadcast(r);
+            } else if (tag == &done_tag) {
+                appended = true;
+            } else if (tag == &wake_tag) {
+                break;
+            } else {
+                struct reactor_conn *conn = tag;
+                if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    if (conn_on_readable(conn) == -1) continue;
+                }
+                if (ev & EPOLLOUT) {
+                    conn_on_writable(conn);
+                }
+            }
+        }
+        // Finishing an append may close its connection, so not while
+        // later events in this batch could still refer to it
+        if (appended) {
+            reactor_on_done(r);
+        }
+        if (!stop_flag && !TAILQ_EMPTY(&r->run)) {
+            reactor_round(r, n == 0);
+        }
+    }
+    return NULL;
+}
+
+static int reactor_add(struct reactor *r, int fd, uint32_t events, void *tag) {
+    struct epoll_event ev = { .events = events, .data.ptr = tag };
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        syslog(LOG_ERR, "epoll_ctl add failed: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// Open another member of sockfd's SO_REUSEPORT group for a shard, or take
+// over one the previous process handed us, queued connections and all
+static int shard_listener(void) {
+    int fd = handoff_take_listener();
+    if (fd == -1) {
+        fd = get_listener_socket(PORT, true);
+        if (fd == -1) {
+            return -1;
+        }
+        if (listen(fd, config.backlog) == -1) {
+            syslog(LOG_ERR, "Failed to listen on shard socket: %s", strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+    if (set_nonblocking(fd) == -1) {
+        syslog(LOG_ERR, "Failed to set up shard listener: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    handoff_add_listener(fd);
+    return fd;
+}
+
+static int reactor_init(struct reactor *r, int index) {
+    bool sharded = config.mode == SERVER_MODE_SHARD;
+    LIST_INIT(&r->conns);
+    LIST_INIT(&r->subscribers);
+    LIST_INIT(&r->spare);
+    TAILQ_INIT(&r->run);
+    r->timer_fd = -1;
+    r->broadcast_fd = -1;
+    r->done_fd = -1;
+    r->listen_fd = (sharded && index > 0) ? shard_listener() : sockfd;
+    if (r->listen_fd == -1) {
+        return -1;
+    }
+    if (arena_init(&r->arena, config.arena_buffers, config.arena_buf_size) == -1 ||
+        !(r->recv_buf = arena_alloc(&r->arena, BUF_SIZE, &r->recv_size))) {
+        syslog(LOG_ERR, "Failed to allocate reactor buffers");
+        return -1;
+    }
+    if ((r->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        syslog(LOG_ERR, "epoll_create1 failed: %s", strerror(errno));
+        return -1;
+    }
+    if ((r->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+        reactor_add(r, r->done_fd, EPOLLIN, &done_tag) == -1) {
+        syslog(LOG_ERR, "Failed to set up append completions: %s", strerror(errno));
+        return -1;
+    }
+    // A private listener wakes only its owner; the shared one needs EPOLLEXCLUSIVE
+    uint32_t listen_events = sharded ? EPOLLIN : EPOLLIN | EPOLLEXCLUSIVE;
+    if (reactor_add(r, r->listen_fd, listen_events, &listener_tag) == -1 ||
+        reactor_add(r, wake_fd, EPOLLIN, &wake_tag) == -1 ||
+        (local_fd != -1 && reactor_add(r, local_fd, EPOLLIN | EPOLLEXCLUSIVE, &local_tag) == -1)) {
+        return -1;
+    }
+
+    if (index == 0) {
+        r->timer_fd = timestamp_timer_create();
+        if (r->timer_fd == -1 || reactor_add(r, r->timer_fd, EPOLLIN, &timer_tag) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Wait for the writer to hand back everything this reactor submitted
+static void reactor_wait_appends(struct reactor *r) {
+    while (r->appends_inflight > 0) {
+        struct pollfd pfd = { .fd = r->done_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+            syslog(LOG_ERR, "Failed to wait for appends: %s", strerror(errno));
+            return;
+        }
+        reactor_on_done(r);
+    }
+}
+
+static void reactor_destroy(struct reactor *r) {
+    // Lines already with the writer are committed; try to tell their clients
+    if (r->done_fd != -1) {
+        reactor_wait_appends(r);
+        close(r->done_fd);
+    }
+    while (!LIST_EMPTY(&r->conns)) {
+        conn_close(LIST_FIRST(&r->conns));
+    }
+    while (!LIST_EMPTY(&r->spare)) {
+        struct reactor_conn *conn = LIST_FIRST(&r->spare);
+        LIST_REMOVE(conn, entries);
+        free(conn);
+    }
+    arena_free(&r->arena, r->recv_buf);
+    arena_destroy(&r->arena);
+    if (r->timer_fd != -1) close(r->timer_fd);
+    if (r->broadcast_fd != -1) {
+        broadcast_unwatch(r->broadcast_fd);
+        close(r->broadcast_fd);
+    }
+    if (r->epfd != -1) close(r->epfd);
+    if (r->listen_fd != -1 && r->listen_fd != sockfd) close(r->listen_fd);
+}
+
+// Pin shard index to the index-th CPU this process may run on
+static void shard_affinity(pthread_attr_t *attr, int index) {
+    cpu_set_t allowed, pinned;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0) {
+        return;
+    }
+    int target = index % CPU_COUNT(&allowed);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+            CPU_ZERO(&pinned);
+            CPU_SET(cpu, &pinned);
+            if (pthread_attr_setaffinity_np(attr, sizeof(pinned), &pinned) != 0) {
+                syslog(LOG_ERR, "Failed to pin reactor %d to CPU %d", index, cpu);
+            }
+            return;
+        }
+    }
+}
+
+int run_reactor(void) {
+    int nthreads = config.io_threads;
+    if (nthreads <= 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpu > 0 ? (int)ncpu : 1;
+    }
+
+    if (set_nonblocking(sockfd) == -1 || (local_fd != -1 && set_nonblocking(local_fd) == -1)) {
+        syslog(LOG_ERR, "Failed to make listener non-blocking: %s", strerror(errno));
+        return -1;
+    }
+
+    struct reactor *reactors = calloc(nthreads, sizeof(*reactors));
+    if (!reactors) {
+        syslog(LOG_ERR, "Failed to allocate reactors");
+        return -1;
+    }
+
+    int rc = 0;
+    int started = 0;
+    for (int i = 0; i < nthreads; i++) {
+        reactors[i].epfd = -1;
+        reactors[i].listen_fd = -1;
+        reactors[i].broadcast_fd = -1;
+        reactors[i].timer_fd = -1;
+        reactors[i].done_fd = -1;
+    }
+    for (int i = 0; i < nthreads; i++) {
+        if (reactor_init(&reactors[i], i) == -1) {
+            rc = -1;
+            break;
+        }
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        if (config.mode == SERVER_MODE_SHARD) {
+            shard_affinity(&attr, i);
+        }
+        int err = pthread_create(&reactors[i].thread, &attr, reactor_thread, &reactors[i]);
+        pthread_attr_destroy(&attr);
+        if (err != 0) {
+            syslog(LOG_ERR, "Failed to create reactor thread");
+            rc = -1;
+            break;
+        }
+        started++;
+    }
+    syslog(LOG_INFO, "epoll reactor running with %d thread(s)%s", started,
+           config.mode == SERVER_MODE_SHARD ? ", one listener each" : "");
+
+    if (rc == -1) {
+        stop_flag = 1;
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) == -1) {
+            syslog(LOG_ERR, "Failed to wake reactor threads: %s", strerror(errno));
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        reactor_destroy(&reactors[i]);
+    }
+    free(reactors);
+    return rc;
+}
@@ -0,0 +1,162 @@
+/***********************************************************************
+* @file  registry.c
+* @version 2
+* @brief  Slab backed registry of active client connections
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release, replaces the ever growing thread_list_head SLIST.
+*   1 registry_drain() lets in-flight requests finish before a hot upgrade
+*   2 registry_remove() closes the client socket under registry_mutex
+*
+* Slots are carved out of fixed size slabs that are never returned to the
+* heap, and recycled through a free list, so a connect/disconnect storm
+* settles at a constant footprint. Active slots sit on a doubly linked LIST
+* so a client that disconnects is unlinked in O(1).
+*
+* A slot's socket is closed only by registry_remove(), with the slot unlinked
+* under the same lock. Until then the descriptor number cannot be reused, so a
+* shutdown() from registry_shutdown_all() or registry_drain() always reaches
+* the client it was meant for.
+*/
+
+#define _POSIX_C_SOURCE 200112L  // Enable POSIX features
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+
+#define REGISTRY_SLAB_SLOTS 64  // Slots allocated at a time
+
+// Slabs are chained together so they can be freed at exit
+struct conn_slab {
+    struct conn_slab *next;
+    struct conn_slot slots[REGISTRY_SLAB_SLOTS];
+};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t registry_empty = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(, conn_slot) active_slots = LIST_HEAD_INITIALIZER(active_slots);
+static LIST_HEAD(, conn_slot) free_slots = LIST_HEAD_INITIALIZER(free_slots);
+static struct conn_slab *slabs;
+static size_t active_count;
+static bool draining;  // Set once shutdown has begun
+
+// Grow the free list by one slab; caller holds registry_mutex
+static int registry_grow(void) {
+    struct conn_slab *slab = calloc(1, sizeof(*slab));
+    if (!slab) {
+        return -1;
+    }
+    slab->next = slabs;
+    slabs = slab;
+    for (int i = 0; i < REGISTRY_SLAB_SLOTS; i++) {
+        LIST_INSERT_HEAD(&free_slots, &slab->slots[i], entries);
+    }
+    return 0;
+}
+
+struct conn_slot *registry_add(int client_fd) {
+    pthread_mutex_lock(&registry_mutex);
+    if (LIST_EMPTY(&free_slots) && registry_grow() == -1) {
+        pthread_mutex_unlock(&registry_mutex);
+        aesd_log_ratelimited(LOG_ERR, "Failed to allocate connection slab");
+        return NULL;
+    }
+    struct conn_slot *slot = LIST_FIRST(&free_slots);
+    LIST_REMOVE(slot, entries);
+    slot->client_fd = client_fd;
+    LIST_INSERT_HEAD(&active_slots, slot, entries);
+    active_count++;
+    if (draining) {
+        shutdown(client_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+    return slot;
+}
+
+void registry_remove(struct conn_slot *slot) {
+    pthread_mutex_lock(&registry_mutex);
+    LIST_REMOVE(slot, entries);
+    close(slot->client_fd);
+    slot->client_fd = -1;
+    LIST_INSERT_HEAD(&free_slots, slot, entries);
+    if (--active_count == 0) {
+        pthread_cond_broadcast(&registry_empty);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+size_t registry_active(void) {
+    pthread_mutex_lock(&registry_mutex);
+    size_t count = active_count;
+    pthread_mutex_unlock(&registry_mutex);
+    return count;
+}
+
+// Shut down every active client socket, and any registered later on
+void registry_shutdown_all(void) {
+    pthread_mutex_lock(&registry_mutex);
+    draining = true;
+    struct conn_slot *slot;
+    LIST_FOREACH(slot, &active_slots, entries) {
+        shutdown(slot->client_fd, SHUT_RDWR);  // Force unblock recv/send
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+// Block until every registered connection has been removed
+void registry_wait_empty(void) {
+    pthread_mutex_lock(&registry_mutex);
+    while (active_count > 0) {
+        pthread_cond_wait(&registry_empty, &registry_mutex);
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+// Shut down the read side of every active client, so each finishes the
+// request it is on and then sees EOF; wait up to timeout_ms for them to go
+void registry_drain(int timeout_ms) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&registry_mutex);
+    struct conn_slot *slot;
+    LIST_FOREACH(slot, &active_slots, entries) {
+        shutdown(slot->client_fd, SHUT_RD);
+    }
+    while (active_count > 0) {
+        if (pthread_cond_timedwait(&registry_empty, &registry_mutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_mutex);
+}
+
+// Release the slabs; only valid once no connection is registered
+void registry_destroy(void) {
+    pthread_mutex_lock(&registry_mutex);
+    while (slabs) {
+        struct conn_slab *next = slabs->next;
+        free(slabs);
+        slabs = next;
+    }
+    LIST_INIT(&free_slots);
+    pthread_mutex_unlock(&registry_mutex);
+}
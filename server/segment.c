@@ -0,0 +1,311 @@
+/***********************************************************************
+* @file  segment.c
+* @version 0
+* @brief  Segmented retention window for the DATA_FILE backend (-R)
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*
+* DATA_FILE is divided into fixed-size segments, segment k holding bytes
+* [k * size, (k + 1) * size). For each segment this module records the
+* first entry (append) that starts in it, how many entries start in it,
+* and when it was last written. Once the retained window exceeds a -R
+* limit (bytes, entries or age), the oldest segment is dropped. The window
+* then starts at the next entry boundary, so replies never begin mid-entry.
+* The segment being written is never dropped.
+*
+* Dropping a segment only moves the window start, which is O(1). Its disk
+* space is freed with FALLOC_FL_PUNCH_HOLE, so offsets in the file stay
+* absolute, and sendfile() and binary READ offsets keep working. The -S mmap
+* log would still exhaust its address space reservation, so only -S file
+* takes -R. A reply pins the segment its window starts in. A pinned
+* segment, and everything after it, is only punched once the last such
+* reply is done, so a reply never sends the zeros of a freed range.
+*
+* The writer (or the io_uring loop) records entries and applies retention.
+* Replies pin and unpin from any thread, all under segment_mutex.
+*
+*Ref:
+* 1. fallocate(2) FALLOC_FL_PUNCH_HOLE
+*/
+
+#define _GNU_SOURCE  // fallocate(), FALLOC_FL_*
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include "aesdsocket.h"
+
+struct segment {
+    off_t first_entry;           // Start of the first entry beginning here, -1 if none
+    uint64_t entries;            // Entries beginning here
+    time_t newest;               // Last append touching it, CLOCK_MONOTONIC seconds
+    unsigned pins;               // Replies whose window starts here
+};
+
+// What goes over the handoff socket, followed by count struct segment
+struct segment_state {
+    uint64_t first;
+    uint64_t count;
+    uint64_t end;
+    int64_t base;
+    uint64_t entries;
+};
+
+static pthread_mutex_t segment_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int segment_fd = -1;      // Write fd on DATA_FILE, for punching only
+static struct segment *ring;     // Oldest tracked segment at ring[ring_head]
+static size_t ring_cap, ring_head, ring_count;
+static uint64_t first_seg;       // Number of the oldest tracked segment
+static off_t window_end;         // Bytes ever appended
+static off_t window_base;        // First retained byte, an entry boundary
+static uint64_t window_entries;  // Entries starting at or after window_base
+static bool punch_unsupported;
+static bool loaded;              // State came from a predecessor
+
+static inline struct segment *seg_at(uint64_t number) {
+    return &ring[(ring_head + (number - first_seg)) % ring_cap];
+}
+
+static time_t now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+// Track segments up to and including number; caller holds segment_mutex
+static int track_until(uint64_t number) {
+    while (first_seg + ring_count <= number) {
+        if (ring_count == ring_cap) {
+            size_t new_cap = ring_cap ? ring_cap * 2 : 64;
+            struct segment *grown = malloc(new_cap * sizeof(*grown));
+            if (!grown) {
+                return -1;
+            }
+            for (size_t i = 0; i < ring_count; i++) {
+                grown[i] = ring[(ring_head + i) % ring_cap];
+            }
+            free(ring);
+            ring = grown;
+            ring_cap = new_cap;
+            ring_head = 0;
+        }
+        struct segment *seg = &ring[(ring_head + ring_count) % ring_cap];
+        memset(seg, 0, sizeof(*seg));
+        seg->first_entry = -1;
+        ring_count++;
+    }
+    return 0;
+}
+
+// Free dropped segments no reply still needs, oldest first; returns the
+// byte range to punch, empty if none. Caller holds segment_mutex.
+static void release_dropped(off_t *from, off_t *to) {
+    uint64_t base_seg = window_base / config.retention.segment_size;
+    *from = *to = (off_t)(first_seg * config.retention.segment_size);
+    while (first_seg < base_seg && ring[ring_head].pins == 0) {
+        ring_head = (ring_head + 1) % ring_cap;
+        ring_count--;
+        first_seg++;
+        *to += config.retention.segment_size;
+    }
+}
+
+static void punch(off_t from, off_t to) {
+    if (from == to || punch_unsupported) {
+        return;
+    }
+    if (fallocate(segment_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from, to - from) == -1) {
+        if (errno == EOPNOTSUPP) {
+            // Replies still honour the window; only the disk space is kept
+            syslog(LOG_WARNING, "Data file cannot punch holes, dropped segments keep their space");
+            punch_unsupported = true;
+        } else {
+            aesd_log_ratelimited(LOG_ERR, "Failed to free dropped segments: %s", strerror(errno));
+        }
+    }
+}
+
+int segment_init(void) {
+    segment_fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (segment_fd == -1) {
+        syslog(LOG_ERR, "Failed to open data file for retention: %s", strerror(errno));
+        return -1;
+    }
+    if (loaded) {
+        return 0;
+    }
+    // The window's first segment is tracked from here on, so pins always land
+    pthread_mutex_lock(&segment_mutex);
+    int rc = track_until(0);
+    pthread_mutex_unlock(&segment_mutex);
+    if (rc == -1) {
+        syslog(LOG_ERR, "Failed to allocate the segment table");
+        return -1;
+    }
+    // Whatever an older predecessor left behind counts as one entry
+    struct stat st;
+    if (fstat(segment_fd, &st) == 0 && st.st_size > 0) {
+        segment_append(0, st.st_size);
+    }
+    return 0;
+}
+
+void segment_append(off_t start, size_t len) {
+    size_t size = config.retention.segment_size;
+    time_t now = now_seconds();
+    pthread_mutex_lock(&segment_mutex);
+    uint64_t last = (start + len - 1) / size;
+    if (track_until(last) == -1) {
+        // Untracked bytes stay in the window until a later append tracks them
+        pthread_mutex_unlock(&segment_mutex);
+        aesd_log_ratelimited(LOG_ERR, "Failed to track data file segments");
+        return;
+    }
+    struct segment *seg = seg_at(start / size);
+    if (seg->first_entry == -1) {
+        seg->first_entry = start;
+    }
+    seg->entries++;
+    for (uint64_t n = start / size; n <= last; n++) {
+        seg_at(n)->newest = now;
+    }
+    window_entries++;
+    window_end = start + len;
+    pthread_mutex_unlock(&segment_mutex);
+}
+
+// Whether the oldest retained segment has to go under the -R limits
+static bool over_limit(const struct segment *oldest, time_t now) {
+    const struct retention_config *rc = &config.retention;
+    return (rc->bytes && (uint64_t)(window_end - window_base) > rc->bytes) ||
+           (rc->entries && window_entries > rc->entries) ||
+           (rc->age && now - oldest->newest > rc->age);
+}
+
+off_t segment_retain(void) {
+    size_t size = config.retention.segment_size;
+    time_t now = now_seconds();
+    uint64_t dropped = 0;
+    off_t from, to;
+
+    pthread_mutex_lock(&segment_mutex);
+    uint64_t active = window_end > 0 ? (uint64_t)(window_end - 1) / size : 0;
+    for (;;) {
+        uint64_t oldest = window_base / size;
+        if (oldest >= active || !over_limit(seg_at(oldest), now)) {
+            break;
+        }
+        // The window moves to the next entry starting after this segment;
+        // segments in between are the tail of an entry that is going too
+        uint64_t next = oldest + 1;
+        while (next <= active && seg_at(next)->first_entry == -1) {
+            next++;
+        }
+        if (next > active) {
+            break;
+        }
+        for (uint64_t n = oldest; n < next; n++) {
+            window_entries -= seg_at(n)->entries;
+            dropped++;
+        }
+        window_base = seg_at(next)->first_entry;
+    }
+    release_dropped(&from, &to);
+    off_t base = window_base;
+    pthread_mutex_unlock(&segment_mutex);
+
+    punch(from, to);
+    if (dropped) {
+        stats_add(STAT_SEGMENTS_DROPPED, dropped);
+    }
+    return base;
+}
+
+off_t segment_pin(void) {
+    if (!config.retention.segment_size) {
+        return 0;
+    }
+    pthread_mutex_lock(&segment_mutex);
+    off_t base = window_base;
+    seg_at(base / config.retention.segment_size)->pins++;
+    pthread_mutex_unlock(&segment_mutex);
+    return base;
+}
+
+void segment_unpin(off_t base) {
+    if (!config.retention.segment_size) {
+        return;
+    }
+    off_t from, to;
+    pthread_mutex_lock(&segment_mutex);
+    seg_at(base / config.retention.segment_size)->pins--;
+    release_dropped(&from, &to);
+    pthread_mutex_unlock(&segment_mutex);
+    punch(from, to);
+}
+
+int segment_save(int fd) {
+    pthread_mutex_lock(&segment_mutex);
+    struct segment_state state = {
+        .first = first_seg,
+        .count = ring_count,
+        .end = window_end,
+        .base = window_base,
+        .entries = window_entries,
+    };
+    int rc = write_full(fd, &state, sizeof(state));
+    for (size_t i = 0; i < ring_count && rc == 0; i++) {
+        struct segment seg = ring[(ring_head + i) % ring_cap];
+        seg.pins = 0;
+        rc = write_full(fd, &seg, sizeof(seg));
+    }
+    pthread_mutex_unlock(&segment_mutex);
+    return rc;
+}
+
+int segment_load(int fd) {
+    struct segment_state state;
+    if (read_full(fd, &state, sizeof(state)) == -1) {
+        return -1;
+    }
+    pthread_mutex_lock(&segment_mutex);
+    first_seg = state.first;
+    ring_count = 0;
+    int rc = 0;
+    for (uint64_t i = 0; i < state.count && rc == 0; i++) {
+        rc = track_until(first_seg + i);
+        if (rc == 0) {
+            rc = read_full(fd, seg_at(first_seg + i), sizeof(struct segment));
+        }
+    }
+    window_end = state.end;
+    window_base = state.base;
+    window_entries = state.entries;
+    loaded = rc == 0;
+    pthread_mutex_unlock(&segment_mutex);
+    return rc;
+}
+
+void segment_destroy(void) {
+    pthread_mutex_lock(&segment_mutex);
+    free(ring);
+    ring = NULL;
+    ring_cap = ring_head = ring_count = 0;
+    pthread_mutex_unlock(&segment_mutex);
+    if (segment_fd != -1) {
+        close(segment_fd);
+        segment_fd = -1;
+    }
+}
@@ -0,0 +1,259 @@
+/***********************************************************************
+* @file  stats.c
+* @version 1
+* @brief  Latency histograms and counters for aesdsocket
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*   1 accept is timed from the listener polling readable, not from accept() returning
+*
+* Every thread records into its own shard, so the hot path takes no lock and
+* does no atomic read-modify-write. Each slot has a single writer, and a
+* relaxed load/store pair is enough for a reader summing the shards. A shard
+* is handed back when its thread exits and reused by the next thread, so
+* thread mode's per-client threads keep a bounded number of shards while
+* their counts carry on.
+*
+* The histograms are log-linear in the style of HdrHistogram: values below
+* 16 ns get exact buckets, and every power of two above that is split into
+* 16 sub-buckets, so a reported percentile is within 1/16 of the true value.
+*
+* What each operation measures:
+*   accept    the listener polling readable until the client is handed to its
+*             server; for -m uring, from the accept's completion
+*   recv      one recv() call; blocking modes include waiting for the peer
+*   append    queueing and committing one line to DATA_FILE
+*   send      streaming one reply to the client
+*   seek      the AESDCHAR_IOCSEEKTO ioctl
+*   lockwait  time spent waiting for file_mutex
+*/
+
+#define _POSIX_C_SOURCE 200112L  // Enable POSIX features
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include "aesdsocket.h"
+
+#define STATS_SUB_BITS 4
+#define STATS_SUB_COUNT (1 << STATS_SUB_BITS)
+#define STATS_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB_COUNT)
+
+struct stats_shard {
+    struct stats_shard *next;
+    bool in_use;
+    uint64_t counters[STAT_COUNTER_COUNT];
+    uint64_t max[STAT_OP_COUNT];
+    uint64_t buckets[STAT_OP_COUNT][STATS_BUCKETS];
+};
+
+static const char *const op_names[STAT_OP_COUNT] = {
+    [STAT_ACCEPT] = "accept",
+    [STAT_RECV] = "recv",
+    [STAT_APPEND] = "append",
+    [STAT_SEND] = "send",
+    [STAT_SEEK] = "seek",
+    [STAT_LOCK_WAIT] = "lockwait",
+};
+
+static const char *const counter_names[STAT_COUNTER_COUNT] = {
+    [STAT_BYTES_IN] = "bytes_in",
+    [STAT_BYTES_OUT] = "bytes_out",
+    [STAT_MESSAGES] = "messages",
+    [STAT_CONNECTIONS] = "connections_total",
+    [STAT_SUBSCRIBER_SKIPS] = "subscriber_skips",
+    [STAT_SUBSCRIBER_DROPS] = "subscriber_drops",
+    [STAT_SEGMENTS_DROPPED] = "segments_dropped",
+    [STAT_ARENA_MISSES] = "arena_misses",
+    [STAT_FAIR_DEFERRALS] = "fair_deferrals",
+    [STAT_UDP_BATCHES] = "udp_batches",
+    [STAT_UDP_DROPS] = "udp_drops",
+};
+
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_shard *shards;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_shard *my_shard;
+static long active_connections;
+
+// Thread exit: leave the counts in place for the next thread to continue
+static void shard_release(void *arg) {
+    struct stats_shard *shard = arg;
+    pthread_mutex_lock(&shards_mutex);
+    shard->in_use = false;
+    pthread_mutex_unlock(&shards_mutex);
+}
+
+static void shard_key_create(void) {
+    pthread_key_create(&shard_key, shard_release);
+}
+
+static struct stats_shard *shard_get(void) {
+    if (my_shard) {
+        return my_shard;
+    }
+    pthread_once(&shard_key_once, shard_key_create);
+
+    pthread_mutex_lock(&shards_mutex);
+    struct stats_shard *shard;
+    for (shard = shards; shard && shard->in_use; shard = shard->next) {
+    }
+    if (!shard) {
+        shard = calloc(1, sizeof(*shard));
+        if (shard) {
+            shard->next = shards;
+            shards = shard;
+        }
+    }
+    if (shard) {
+        shard->in_use = true;
+    }
+    pthread_mutex_unlock(&shards_mutex);
+
+    if (!shard) {
+        return NULL;
+    }
+    pthread_setspecific(shard_key, shard);
+    my_shard = shard;
+    return shard;
+}
+
+// Single writer per slot: a plain relaxed load and store, no lock prefix
+static inline void slot_add(uint64_t *slot, uint64_t n) {
+    __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static unsigned bucket_index(uint64_t value) {
+    if (value < STATS_SUB_COUNT) {
+        return value;
+    }
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned sub = (value >> (msb - STATS_SUB_BITS)) & (STATS_SUB_COUNT - 1);
+    return (msb - STATS_SUB_BITS + 1) * STATS_SUB_COUNT + sub;
+}
+
+// Largest value that falls into bucket index
+static uint64_t bucket_value(unsigned index) {
+    if (index < STATS_SUB_COUNT) {
+        return index;
+    }
+    unsigned msb = index / STATS_SUB_COUNT + STATS_SUB_BITS - 1;
+    uint64_t sub = index % STATS_SUB_COUNT;
+    uint64_t low = (STATS_SUB_COUNT + sub) << (msb - STATS_SUB_BITS);
+    return low + (1ULL << (msb - STATS_SUB_BITS)) - 1;
+}
+
+uint64_t stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_record(stat_op_t op, uint64_t start_ns) {
+    struct stats_shard *shard = shard_get();
+    if (!shard) {
+        return;
+    }
+    uint64_t elapsed = stats_now() - start_ns;
+    slot_add(&shard->buckets[op][bucket_index(elapsed)], 1);
+    if (elapsed > shard->max[op]) {
+        __atomic_store_n(&shard->max[op], elapsed, __ATOMIC_RELAXED);
+    }
+}
+
+void stats_add(stat_counter_t counter, uint64_t n) {
+    struct stats_shard *shard = shard_get();
+    if (shard) {
+        slot_add(&shard->counters[counter], n);
+    }
+}
+
+void stats_conn_open(void) {
+    __atomic_add_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+    stats_add(STAT_CONNECTIONS, 1);
+}
+
+void stats_conn_close(void) {
+    __atomic_sub_fetch(&active_connections, 1, __ATOMIC_RELAXED);
+}
+
+void stats_lock(pthread_mutex_t *mutex) {
+    if (pthread_mutex_trylock(mutex) == 0) {
+        return;  // Uncontended, nothing worth timing
+    }
+    uint64_t start = stats_now();
+    pthread_mutex_lock(mutex);
+    stats_record(STAT_LOCK_WAIT, start);
+}
+
+// Upper bound of the bucket covering fraction q of the samples, capped at max
+static uint64_t percentile(const uint64_t *buckets, uint64_t total, uint64_t max, double q) {
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank >= total) rank = total - 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < STATS_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) {
+            return bucket_value(i) < max ? bucket_value(i) : max;
+        }
+    }
+    return max;
+}
+
+size_t stats_report(char *buf, size_t size) {
+    static uint64_t merged[STATS_BUCKETS];  // Guarded by shards_mutex
+    size_t len = 0;
+
+    #define REPORT(...) do { \
+        int n = snprintf(buf + len, size - len, __VA_ARGS__); \
+        if (n > 0) len = (size_t)n < size - len ? len + n : size - 1; \
+    } while (0)
+
+    pthread_mutex_lock(&shards_mutex);
+    for (int op = 0; op < STAT_OP_COUNT; op++) {
+        uint64_t total = 0, max = 0;
+        memset(merged, 0, sizeof(merged));
+        for (struct stats_shard *s = shards; s; s = s->next) {
+            uint64_t m = __atomic_load_n(&s->max[op], __ATOMIC_RELAXED);
+            if (m > max) max = m;
+            for (unsigned i = 0; i < STATS_BUCKETS; i++) {
+                merged[i] += __atomic_load_n(&s->buckets[op][i], __ATOMIC_RELAXED);
+            }
+        }
+        // Count from the buckets themselves so the percentiles stay consistent
+        for (unsigned i = 0; i < STATS_BUCKETS; i++) {
+            total += merged[i];
+        }
+        if (total == 0) {
+            REPORT("%s count=0\n", op_names[op]);
+            continue;
+        }
+        REPORT("%s count=%llu p50=%.1fus p99=%.1fus p999=%.1fus max=%.1fus\n",
+               op_names[op], (unsigned long long)total,
+               percentile(merged, total, max, 0.50) / 1000.0,
+               percentile(merged, total, max, 0.99) / 1000.0,
+               percentile(merged, total, max, 0.999) / 1000.0,
+               max / 1000.0);
+    }
+    for (int c = 0; c < STAT_COUNTER_COUNT; c++) {
+        uint64_t total = 0;
+        for (struct stats_shard *s = shards; s; s = s->next) {
+            total += __atomic_load_n(&s->counters[c], __ATOMIC_RELAXED);
+        }
+        REPORT("%s=%llu\n", counter_names[c], (unsigned long long)total);
+    }
+    pthread_mutex_unlock(&shards_mutex);
+
+    REPORT("connections_active=%ld\n", __atomic_load_n(&active_connections, __ATOMIC_RELAXED));
+    #undef REPORT
+    return len;
+}
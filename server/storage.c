@@ -0,0 +1,568 @@
+/***********************************************************************
+* @file  storage.c
+* @version 4
+* @brief  Storage backends for the aesdsocket history, chosen with -S
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release, replaces the USE_AESD_CHAR_DEVICE #if blocks.
+*   1 Snapshots are drawn from the sink's arena
+*   2 Only file sets retains; the mmap log's reservation outlasts no -R window
+*   3 memory joins appends without a '\n' into one entry, as the driver does
+*   4 append returns the committed prefix; file trims a partly written line
+*
+* Every backend provides the same operations: reset, open, append a batch,
+* read back (send or snapshot), seek to an entry, and close. The writer
+* thread is the only appender, and it calls append with file_mutex held.
+*
+*   file    DATA_FILE, appended with writev(). Replies are sent with
+*           sendfile() straight from the page cache.
+*   mmap    DATA_FILE as a mapped log, see maplog.c. Replies are sent from
+*           the mapping.
+*   char    /dev/aesdchar. The driver keeps the last
+*           AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries and seeks with
+*           AESDCHAR_IOCSEEKTO. A write without a '\n' is held back and
+*           joined to the next ones until a write with a '\n' ends the entry.
+*   memory  The driver's own circular buffer, run in this process. It
+*           behaves like the char device without needing the module, so the
+*           network path can be measured on its own. It holds back and joins
+*           writes the same way.
+*
+* file and mmap never move a committed byte, so a range is read without any
+* lock. char and memory evict their oldest entry, so a reply copies what it
+* needs while holding file_mutex, which keeps out the writer.
+*
+* The build's USE_AESD_CHAR_DEVICE setting picks the default backend.
+*/
+
+#define _GNU_SOURCE  // IOV_MAX
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "../aesd-char-driver/aesd-circular-buffer.h"
+#include "aesdsocket.h"
+
+static int append_fd = -1;       // The writer's descriptor (file and char)
+
+static void fd_close(void);
+
+// Set once the data file has refused sendfile(), so later replies copy directly
+static volatile int zero_copy_unsupported = 0;
+
+/*
+ * The connection's read fd on the backing file, opened on first use and kept
+ * until reply_sink_release(), so replies do no open()/close() of their own.
+ */
+static int sink_data_fd(struct reply_sink *sink) {
+    if (sink->data_fd == -1) {
+        sink->data_fd = open(config.storage->path, O_RDONLY | O_CLOEXEC);
+        if (sink->data_fd == -1) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to open data file: %s", strerror(errno));
+        }
+    }
+    return sink->data_fd;
+}
+
+// Make room for len more bytes after the first used bytes of the snapshot
+static int snapshot_reserve(struct reply_sink *sink, size_t used, size_t len) {
+    if (sink->snapshot_cap - used >= len) {
+        return 0;
+    }
+    size_t new_cap = sink->snapshot_cap ? sink->snapshot_cap : 4 * BUF_SIZE;
+    while (new_cap - used < len) {
+        new_cap *= 2;
+    }
+    char *new_buf = arena_alloc(sink->arena, new_cap, &new_cap);
+    if (!new_buf) {
+        aesd_log(LOG_ERR, "Failed to grow history snapshot");
+        return -1;
+    }
+    if (used > 0) {
+        memcpy(new_buf, sink->snapshot, used);
+    }
+    arena_free(sink->arena, sink->snapshot);
+    sink->snapshot = new_buf;
+    sink->snapshot_cap = new_cap;
+    return 0;
+}
+
+// Open path for the writer; returns its current length
+static off_t fd_open(const char *path) {
+    append_fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (append_fd == -1) {
+        syslog(LOG_ERR, "Failed to open data file: %s", strerror(errno));
+        return -1;
+    }
+    // Sole appender, so each batch then ends at this plus what it adds
+    off_t len = lseek(append_fd, 0, SEEK_END);
+    if (len == -1) {
+        syslog(LOG_ERR, "lseek failed: %s", strerror(errno));
+        fd_close();
+    }
+    return len;
+}
+
+// Write every request in the batch, IOV_MAX lines per writev()
+// A failed writev() may have taken part of a line. Cut it off, so the file
+// ends with the last committed one. The device takes whole writes only.
+static void fd_trim(size_t partial) {
+    struct stat st;
+    if (fstat(append_fd, &st) == -1 || ftruncate(append_fd, st.st_size - partial) == -1) {
+        aesd_log_ratelimited(LOG_ERR, "Failed to trim a partly written line: %s", strerror(errno));
+    }
+}
+
+static size_t fd_append(const struct append_req *batch) {
+    struct iovec iov[IOV_MAX];
+    const struct append_req *req = batch;
+    size_t committed = 0;
+    while (req) {
+        int iovcnt = 0;
+        for (const struct append_req *r = req; r && iovcnt < IOV_MAX; r = r->next) {
+            iov[iovcnt].iov_base = (void *)r->data;
+            iov[iovcnt].iov_len = r->len;
+            iovcnt++;
+        }
+
+        struct iovec *cur = iov;
+        while (iovcnt > 0) {
+            ssize_t written = writev(append_fd, cur, iovcnt);
+            if (written == -1) {
+                if (errno == EINTR) continue;
+                aesd_log_ratelimited(LOG_ERR, "Write failed: %s", strerror(errno));
+                if (cur->iov_len < req->len) {
+                    fd_trim(req->len - cur->iov_len);
+                }
+                return committed;
+            }
+            while (iovcnt > 0 && (size_t)written >= cur->iov_len) {
+                written -= cur->iov_len;
+                cur++;
+                iovcnt--;
+                req = req->next;
+                committed++;
+            }
+            if (iovcnt > 0) {
+                cur->iov_base = (char *)cur->iov_base + written;
+                cur->iov_len -= written;
+            }
+        }
+    }
+    return committed;
+}
+
+static void fd_close(void) {
+    if (append_fd != -1) {
+        close(append_fd);
+        append_fd = -1;
+    }
+}
+
+// AESDCHAR_IOCSEEKTO on the connection's own fd, so only its position moves
+static off_t fd_seek(struct reply_sink *sink, uint32_t cmd, uint32_t offset) {
+    int fd = sink_data_fd(sink);
+    if (fd < 0) {
+        return -1;
+    }
+    struct aesd_seekto seekto = { .write_cmd = cmd, .write_cmd_offset = offset };
+    if (ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto) == -1) {
+        return -1;
+    }
+    return lseek(fd, 0, SEEK_CUR);
+}
+
+static int data_file_reset(void) {
+    int fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to truncate data file: %s", strerror(errno));
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+static void data_file_discard(void) {
+    remove(DATA_FILE);
+}
+
+static off_t file_open(void) {
+    return fd_open(DATA_FILE);
+}
+
+// Batches are committed under file_mutex, so this size ends on a whole append
+static off_t file_length(struct reply_sink *sink) {
+    int fd = sink_data_fd(sink);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    stats_lock(&file_mutex);
+    int rc = fstat(fd, &st);
+    pthread_mutex_unlock(&file_mutex);
+    return rc == -1 ? -1 : st.st_size;
+}
+
+/*
+ * Send bytes [start, end) of the data file. The file is append-only, so this
+ * range cannot change once end has been committed and needs no lock.
+ */
+static void file_send(struct reply_sink *sink, off_t start, off_t end) {
+    int fd = sink_data_fd(sink);
+    if (fd < 0) {
+        return;
+    }
+    off_t offset = start;
+    if (sink->sock_fd != -1 && !zero_copy_unsupported) {
+        while (offset < end) {
+            size_t count = end - offset < ZERO_COPY_CHUNK ? end - offset : ZERO_COPY_CHUNK;
+            ssize_t sent = sendfile(sink->sock_fd, fd, &offset, count);
+            if (sent > 0) {
+                stats_add(STAT_BYTES_OUT, sent);
+                continue;
+            }
+            if (sent == -1 && errno == EINTR) continue;
+            if (sent == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                aesd_log(LOG_INFO, "Data file does not support zero-copy, falling back to read/send");
+                zero_copy_unsupported = 1;
+                break;
+            }
+            if (sent == -1) {
+                aesd_log_ratelimited(LOG_ERR, "sendfile failed: %s", strerror(errno));
+            }
+            return;  // Socket error, or the file shrank underneath us
+        }
+    }
+
+    char send_buf[BUF_SIZE];
+    while (offset < end) {
+        size_t want = end - offset < BUF_SIZE ? end - offset : BUF_SIZE;
+        ssize_t bytes_read = pread(fd, send_buf, want, offset);
+        if (bytes_read <= 0) {
+            break;
+        }
+        offset += bytes_read;
+        if (sink->write(sink->ctx, send_buf, bytes_read) == -1) {
+            break;
+        }
+    }
+}
+
+static off_t mmap_open(void) {
+    if (maplog_open(DATA_FILE) == -1) {
+        return -1;
+    }
+    return maplog_length();
+}
+
+// The published length always ends on a whole batch; no lock needed
+static off_t mmap_length(struct reply_sink *sink) {
+    (void)sink;
+    return maplog_length();
+}
+
+// Send bytes [start, end) from the mapping itself
+static void mmap_send(struct reply_sink *sink, off_t start, off_t end) {
+    if (end > start) {
+        sink->write(sink->ctx, maplog_data() + start, end - start);
+    }
+}
+
+static int char_reset(void) {
+    return 0;  // The driver's history outlives us
+}
+
+static off_t char_open(void) {
+    // The driver evicts entries, so count every byte appended from here on
+    return fd_open(CHAR_DEVICE) == -1 ? -1 : 0;
+}
+
+/*
+ * The driver evicts old entries, so a range of it is not stable once the lock
+ * is dropped. Copy up to max bytes from start into the sink's snapshot buffer
+ * instead; the history is at most AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ * entries.
+ */
+static ssize_t char_snapshot(struct reply_sink *sink, off_t start, size_t max) {
+    int fd = sink_data_fd(sink);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t len = 0;
+    while (len < max) {
+        if (snapshot_reserve(sink, len, BUF_SIZE) == -1) {
+            return -1;
+        }
+        // pread leaves the position an earlier ioctl seek set alone
+        size_t want = sink->snapshot_cap - len;
+        if (want > max - len) want = max - len;
+        ssize_t bytes_read = pread(fd, sink->snapshot + len, want, start + len);
+        if (bytes_read == -1 && errno == EINTR) continue;
+        if (bytes_read == -1) {
+            aesd_log_ratelimited(LOG_ERR, "Read failed: %s", strerror(errno));
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        len += bytes_read;
+    }
+    return len;
+}
+
+// The memory backend's entries, guarded by file_mutex like the device's
+static struct aesd_circular_buffer memory_buffer;
+static struct aesd_buffer_entry memory_held;  // Entry still waiting for its '\n'
+
+static void memory_free(void) {
+    uint8_t index;
+    struct aesd_buffer_entry *entry;
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &memory_buffer, index) {
+        free((char *)entry->buffptr);
+    }
+    aesd_circular_buffer_init(&memory_buffer);
+    free((char *)memory_held.buffptr);
+    memory_held.buffptr = NULL;
+    memory_held.size = 0;
+}
+
+static int memory_reset(void) {
+    memory_free();
+    return 0;
+}
+
+static off_t memory_open(void) {
+    return 0;
+}
+
+// As aesd_write(): join data to the held entry, which is added once data has a '\n'
+static int memory_write(const char *data, size_t len) {
+    char *grown = realloc((char *)memory_held.buffptr, memory_held.size + len);
+    if (!grown) {
+        aesd_log_ratelimited(LOG_ERR, "Failed to allocate history entry");
+        return -1;
+    }
+    memcpy(grown + memory_held.size, data, len);
+    memory_held.buffptr = grown;
+    memory_held.size += len;
+    if (memchr(data, '\n', len)) {
+        free((char *)aesd_circular_buffer_add_entry(&memory_buffer, &memory_held));
+        memory_held.buffptr = NULL;
+        memory_held.size = 0;
+    }
+    return 0;
+}
+
+static size_t memory_append(const struct append_req *batch) {
+    size_t committed = 0;
+    for (const struct append_req *req = batch; req; req = req->next) {
+        if (memory_write(req->data, req->len) == -1) {
+            break;
+        }
+        committed++;
+    }
+    return committed;
+}
+
+// Entries are freed only once a handoff no longer needs them
+static void memory_discard(void) {
+    pthread_mutex_lock(&file_mutex);
+    memory_free();
+    pthread_mutex_unlock(&file_mutex);
+}
+
+// Entry i counting from the oldest held, or NULL past the newest
+static const struct aesd_buffer_entry *memory_entry(unsigned i) {
+    size_t held = memory_buffer.full ? AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+                                     : (size_t)((memory_buffer.in_offs - memory_buffer.out_offs +
+                                                 AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) %
+                                                AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+    if (i >= held) {
+        return NULL;
+    }
+    return &memory_buffer.entry[(memory_buffer.out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+}
+
+static ssize_t memory_snapshot(struct reply_sink *sink, off_t start, size_t max) {
+    size_t entry_offset;
+    const struct aesd_buffer_entry *first =
+        aesd_circular_buffer_find_entry_offset_for_fpos(&memory_buffer, start, &entry_offset);
+    size_t len = 0;
+    for (unsigned i = 0; first && len < max; i++) {
+        const struct aesd_buffer_entry *entry = memory_entry(i);
+        if (!entry) {
+            break;
+        }
+        if (entry != first && len == 0) {
+            continue;  // Before the entry holding start
+        }
+        size_t skip = len == 0 ? entry_offset : 0;
+        size_t n = entry->size - skip;
+        if (n > max - len) n = max - len;
+        if (snapshot_reserve(sink, len, n) == -1) {
+            return -1;
+        }
+        memcpy(sink->snapshot + len, entry->buffptr + skip, n);
+        len += n;
+    }
+    return len;
+}
+
+// The driver's AESDCHAR_IOCSEEKTO rules, with entry 0 the oldest held
+static off_t memory_seek(struct reply_sink *sink, uint32_t cmd, uint32_t offset) {
+    (void)sink;
+    off_t pos = 0;
+    for (unsigned i = 0; i < cmd; i++) {
+        const struct aesd_buffer_entry *entry = memory_entry(i);
+        if (!entry) {
+            errno = EINVAL;
+            return -1;
+        }
+        pos += entry->size;
+    }
+    const struct aesd_buffer_entry *entry = memory_entry(cmd);
+    if (!entry || offset >= entry->size) {
+        errno = EINVAL;
+        return -1;
+    }
+    return pos + offset;
+}
+
+// The entries oldest first, each a uint64_t length and its bytes after a
+// uint64_t count, then the held entry the same way, length 0 if none
+static int memory_save(int fd) {
+    uint64_t count = 0;
+    while (memory_entry(count)) {
+        count++;
+    }
+    int rc = write_full(fd, &count, sizeof(count));
+    for (unsigned i = 0; i < count && rc == 0; i++) {
+        const struct aesd_buffer_entry *entry = memory_entry(i);
+        uint64_t len = entry->size;
+        rc = write_full(fd, &len, sizeof(len));
+        if (rc == 0) {
+            rc = write_full(fd, entry->buffptr, len);
+        }
+    }
+    uint64_t held_len = memory_held.size;
+    if (rc == 0) {
+        rc = write_full(fd, &held_len, sizeof(held_len));
+    }
+    if (rc == 0 && held_len) {
+        rc = write_full(fd, memory_held.buffptr, held_len);
+    }
+    return rc;
+}
+
+static int memory_load(int fd) {
+    uint64_t count;
+    if (read_full(fd, &count, sizeof(count)) == -1) {
+        return -1;
+    }
+    for (uint64_t i = 0; i < count; i++) {
+        uint64_t len;
+        if (read_full(fd, &len, sizeof(len)) == -1 || len == 0 || len > SIZE_MAX) {
+            return -1;
+        }
+        char *copy = malloc(len);
+        if (!copy || read_full(fd, copy, len) == -1) {
+            free(copy);
+            return -1;
+        }
+        struct aesd_buffer_entry entry = { .buffptr = copy, .size = len };
+        free((char *)aesd_circular_buffer_add_entry(&memory_buffer, &entry));
+    }
+    uint64_t held_len;
+    if (read_full(fd, &held_len, sizeof(held_len)) == -1 || held_len > SIZE_MAX) {
+        return -1;
+    }
+    if (held_len) {
+        char *copy = malloc(held_len);
+        if (!copy || read_full(fd, copy, held_len) == -1) {
+            free(copy);
+            return -1;
+        }
+        memory_held.buffptr = copy;
+        memory_held.size = held_len;
+    }
+    return 0;
+}
+
+static const struct storage_ops backends[] = {
+    {
+        .name = "file",
+        .path = DATA_FILE,
+        .uring = true,
+        .retains = true,
+        .reset = data_file_reset,
+        .open = file_open,
+        .append = fd_append,
+        .close = fd_close,
+        .discard = data_file_discard,
+        .length = file_length,
+        .send = file_send,
+        .seek = fd_seek,
+    },
+    {
+        .name = "mmap",
+        .path = DATA_FILE,
+        .reset = data_file_reset,
+        .open = mmap_open,
+        .append = maplog_append_batch,
+        .close = maplog_close,
+        .discard = data_file_discard,
+        .length = mmap_length,
+        .send = mmap_send,
+        .seek = fd_seek,
+    },
+    {
+        .name = "char",
+        .path = CHAR_DEVICE,
+        .evicts = true,
+        .uring = true,
+        .max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+        .reset = char_reset,
+        .open = char_open,
+        .append = fd_append,
+        .close = fd_close,
+        .snapshot = char_snapshot,
+        .seek = fd_seek,
+    },
+    {
+        .name = "memory",
+        .evicts = true,
+        .max_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+        .reset = memory_reset,
+        .open = memory_open,
+        .append = memory_append,
+        .discard = memory_discard,
+        .snapshot = memory_snapshot,
+        .seek = memory_seek,
+        .save = memory_save,
+        .load = memory_load,
+    },
+};
+
+const struct storage_ops *storage_find(const char *name) {
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i].name, name) == 0) {
+            return &backends[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,230 @@
+/***********************************************************************
+* @file  udp.c
+* @version 0
+* @brief  Batched UDP ingest (-u) for producers that need no reply
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*
+* With -u, a UDP socket is bound to the same port number as the TCP
+* listener. Producers that only ever append send each line as a datagram
+* and get nothing back: no connection, no history echo and no ack.
+*
+* One ingest thread drains the socket with recvmmsg(), up to UDP_BATCH_MAX
+* datagrams per call, into buffers it allocates once. Every datagram is one
+* entry. A newline is added if it does not end with one, and it is appended
+* verbatim otherwise, so reserved lines such as AESD_STATS are only commands
+* over TCP and -U. Datagrams longer than -L are dropped and counted as
+* udp_drops. The batch goes to the writer as a single chain, which the
+* backend commits in one append call, and the thread waits for that commit
+* before it reuses the buffers. Meanwhile new datagrams queue in the socket's
+* receive buffer, which is enlarged to UDP_RCVBUF for that purpose.
+*
+* The thread polls only after a short batch. While full batches keep coming,
+* each batch costs one recvmmsg() plus the writer's append. udp_batches in
+* AESD_STATS counts the commits, against messages for the datagrams.
+*
+* The socket is handed to a successor on a hot upgrade like the listeners.
+* Datagrams that arrive during the switch wait in its receive buffer.
+*
+*Ref:
+* 1. recvmmsg(2), udp(7) SO_RCVBUF
+*/
+
+#define _GNU_SOURCE  // recvmmsg()
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+
+#define UDP_BATCH_MAX 64                // Datagrams per recvmmsg() and per append
+#define UDP_DATAGRAM_MAX 65507          // Largest IPv4 UDP payload
+#define UDP_RCVBUF (4 * 1024 * 1024)    // Requested receive buffer; capped by rmem_max
+
+static int udp_fd = -1;
+static pthread_t udp_thread_id;
+static bool udp_running;
+
+// Everything one batch needs, allocated once by udp_start()
+static struct mmsghdr *msgs;
+static struct iovec *iovs;
+static struct append_req *reqs;
+static char *slots;
+static size_t slot_size;         // Longest accepted datagram plus room for a '\n'
+
+int udp_open(void) {
+    // A predecessor's socket may already hold datagrams
+    int fd = handoff_take_udp_socket();
+    if (fd == -1) {
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(NULL, PORT, &hints, &res) != 0) {
+            syslog(LOG_ERR, "getaddrinfo failed for the UDP socket");
+            return -1;
+        }
+        fd = socket(res->ai_family, res->ai_socktype | SOCK_CLOEXEC, res->ai_protocol);
+        if (fd == -1) {
+            syslog(LOG_ERR, "Failed to create UDP socket: %s", strerror(errno));
+            freeaddrinfo(res);
+            return -1;
+        }
+        if (bind(fd, res->ai_addr, res->ai_addrlen) == -1) {
+            syslog(LOG_ERR, "Failed to bind UDP socket: %s", strerror(errno));
+            close(fd);
+            freeaddrinfo(res);
+            return -1;
+        }
+        freeaddrinfo(res);
+    }
+    // Best effort: a smaller buffer only drops more of a burst
+    int rcvbuf = UDP_RCVBUF;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) == -1) {
+        syslog(LOG_WARNING, "Failed to enlarge the UDP receive buffer: %s", strerror(errno));
+    }
+    handoff_add_listener(fd);
+    udp_fd = fd;
+    return 0;
+}
+
+// Append the n datagrams just received as one chain
+static void commit_batch(int n) {
+    size_t count = 0;
+    uint64_t bytes = 0, drops = 0;
+    for (int i = 0; i < n; i++) {
+        char *data = slots + i * slot_size;
+        size_t len = msgs[i].msg_len;
+        bytes += len;
+        if (len >= slot_size || (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+            drops++;
+            continue;
+        }
+        if (len == 0) {
+            continue;
+        }
+        if (data[len - 1] != '\n') {
+            data[len++] = '\n';
+        }
+        reqs[count].data = data;
+        reqs[count].len = len;
+        count++;
+    }
+    stats_add(STAT_BYTES_IN, bytes);
+    stats_add(STAT_MESSAGES, n);
+    if (drops) {
+        stats_add(STAT_UDP_DROPS, drops);
+        aesd_log_ratelimited(LOG_ERR, "Dropped %lu datagram(s) longer than %zu bytes",
+                             (unsigned long)drops, slot_size - 1);
+    }
+    if (count == 0) {
+        return;
+    }
+    uint64_t start = stats_now();
+    if (writer_append_batch(reqs, count) == -1) {
+        aesd_log_ratelimited(LOG_ERR, "Failed to append %zu datagram(s)", count);
+        return;
+    }
+    stats_record(STAT_APPEND, start);
+    stats_add(STAT_UDP_BATCHES, 1);
+}
+
+static void *udp_thread(void *arg) {
+    (void)arg;
+    bool drained = true;
+    while (!stop_flag) {
+        // A full batch means more are likely queued, so skip the poll
+        if (drained) {
+            struct pollfd fds[2] = {
+                { .fd = udp_fd, .events = POLLIN },
+                { .fd = wake_fd, .events = POLLIN },
+            };
+            if (poll(fds, 2, -1) == -1) {
+                if (errno != EINTR) {
+                    aesd_log_ratelimited(LOG_ERR, "UDP poll failed: %s", strerror(errno));
+                }
+                continue;
+            }
+            if (fds[1].revents) {
+                break;
+            }
+        }
+        int n = recvmmsg(udp_fd, msgs, UDP_BATCH_MAX, MSG_DONTWAIT, NULL);
+        if (n == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                aesd_log_ratelimited(LOG_ERR, "UDP receive failed: %s", strerror(errno));
+            }
+            drained = true;
+            continue;
+        }
+        drained = n < UDP_BATCH_MAX;
+        commit_batch(n);
+    }
+    return NULL;
+}
+
+int udp_start(void) {
+    size_t limit = config.max_line_len < UDP_DATAGRAM_MAX ? config.max_line_len : UDP_DATAGRAM_MAX;
+    // One byte more than accepted, so an over-long datagram shows as too long
+    slot_size = limit + 1;
+    msgs = calloc(UDP_BATCH_MAX, sizeof(*msgs));
+    iovs = calloc(UDP_BATCH_MAX, sizeof(*iovs));
+    reqs = calloc(UDP_BATCH_MAX, sizeof(*reqs));
+    slots = malloc(UDP_BATCH_MAX * slot_size);
+    if (!msgs || !iovs || !reqs || !slots) {
+        syslog(LOG_ERR, "Failed to allocate UDP batch buffers");
+        udp_close();
+        return -1;
+    }
+    for (int i = 0; i < UDP_BATCH_MAX; i++) {
+        iovs[i].iov_base = slots + i * slot_size;
+        iovs[i].iov_len = slot_size;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    if (pthread_create(&udp_thread_id, NULL, udp_thread, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to create UDP ingest thread");
+        udp_close();
+        return -1;
+    }
+    udp_running = true;
+    return 0;
+}
+
+void udp_close(void) {
+    if (udp_running) {
+        // The loops are already stopping; make sure the thread sees it
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) == -1) {
+            syslog(LOG_ERR, "Failed to wake the UDP ingest thread: %s", strerror(errno));
+        }
+        pthread_join(udp_thread_id, NULL);
+        udp_running = false;
+    }
+    // Only our descriptor; a successor keeps its own
+    if (udp_fd != -1) {
+        close(udp_fd);
+        udp_fd = -1;
+    }
+    free(msgs);
+    free(iovs);
+    free(reqs);
+    free(slots);
+    msgs = NULL;
+    iovs = NULL;
+    reqs = NULL;
+    slots = NULL;
+}
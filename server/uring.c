@@ -0,0 +1,1160 @@
+/***********************************************************************
+* @file  uring.c
+* @version 9
+* @brief  io_uring execution backend for aesdsocket
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*   1 Latency histograms and the AESD_STATS command
+*   2 Timestamps go to the char device too, at the -T interval
+*   3 Binary frames: appends through the ring, other requests answered from memory
+*   4 AESD_DELTA/AESD_FULL; delta replies start the read at the client's cursor
+*   5 Completed appends feed the broadcast ring; subscribers are sent from it
+*   6 -R retention: appends are recorded per segment, replies read the window
+*   7 Runs the -S file and char backends, chosen at runtime
+*   8 Message copies and overflow reply buffers come from the loop's arena
+*   9 Appends are written one at a time and counted when they complete;
+*     each send carries what its read returned; queued messages are capped
+*
+* A single thread drives one ring. The listener is serviced by a multishot
+* accept and every client by a multishot recv that draws from a provided
+* buffer ring. Writes to DATA_FILE go one at a time: the others, and the
+* timestamp, wait in a queue until the one in flight completes. Its place in
+* the file is therefore known, and history_len only grows by what the
+* completion reports, so a reply never covers bytes not yet written. The
+* history is then read back through a registered buffer, and each send is
+* linked ahead of the next read and sized by what the previous read returned.
+* With the file backend the reply ends at the committed length; the char
+* device evicts old entries, so there the reply is read until EOF. The mmap
+* and memory backends have no descriptor to chain reads from, so main() runs
+* them only with the writer thread.
+*
+* A connection queues at most CONN_LINES_MAX messages. Past that the framer
+* yields, the rest of its input is held, and its recv is cancelled until the
+* replies catch up.
+*
+* A binary APPEND frame is written the same way and answered with its ack,
+* or with an error frame if the write failed.
+* Other binary requests are answered by process_frame() into a heap buffer
+* that is then sent like a stats report; SEEK and READ replies are bounded
+* by -L, so this stays small.
+*
+* An AESD_DELTA session's replies simply start reading at its cursor. On the
+* char device offsets shift as entries are evicted and the size is not known
+* until the linked read hits EOF, so there such a session gets full replies.
+*
+* Under -R each append is recorded in its segment when it completes, and
+* a reply from the data file reads only the retained window, which it pins
+* until the reply is finished.
+*
+* This loop is the only writer, so every completed append is published to
+* the broadcast ring here. An AESD_SUBSCRIBE client gets one send SQE at a
+* time, pointed straight into the shared ring block.
+*
+* The ring is driven through the raw syscalls so no liburing is required.
+*
+*Ref:
+* 1. io_uring_setup(2), io_uring_enter(2), io_uring_register(2) man pages
+* 2. https://kernel.dk/io_uring.pdf
+*/
+
+#define _GNU_SOURCE  // syscall(), MAP_POPULATE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <syslog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "queue.h"
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "aesdsocket.h"
+
+#define RING_ENTRIES 256       // Submission queue size
+#define RECV_BUF_COUNT 256     // Provided buffers for multishot recv (power of 2)
+#define RECV_BUF_SIZE 4096
+#define RECV_BUF_GROUP 0
+#define REPLY_BUF_COUNT 64     // Registered buffers used for history replies
+#define REPLY_CHUNK 65536
+#define CHAIN_MAX 2            // A send linked to the next read
+#define CONN_LINES_MAX 64      // Messages queued per connection before its input is held
+
+// Operation tags kept in the low bits of user_data
+enum uring_op {
+    OP_NONE = 0,
+    OP_ACCEPT,
+    OP_RECV,
+    OP_WRITE,
+    OP_READ,
+    OP_SEND,
+    OP_TIMER,
+    OP_WAKE,
+    OP_PUSH,
+};
+#define OP_MASK 0xFUL  // Connections come from calloc(), so 16 byte aligned
+
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sqe_tail;         // Local tail, published on submit
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ptr, *cq_ptr;
+    size_t sq_size, cq_size, sqes_size;
+};
+
+// A complete message waiting for its reply chain
+struct uring_line {
+    STAILQ_ENTRY(uring_line) entries;
+    int op;                    // AESD_OP_LINE, or a binary frame's opcode
+    size_t len;
+    char data[];
+};
+
+struct uring_conn {
+    int fd;
+    struct line_framer framer;
+    STAILQ_HEAD(, uring_line) lines;
+    size_t queued;             // Messages on lines
+    char *held;                // Input received but left unframed by a yield
+    size_t held_len;
+    size_t held_off;
+    struct uring_line *cur;    // Message whose reply is in flight
+    int inflight;              // Reply SQEs not yet completed
+    bool recv_armed;
+    bool eof;                  // Peer finished sending
+    bool closing;              // Connection is being torn down
+    bool replying;
+    bool reply_failed;
+    int reply_fd;              // File the reply is read from
+    int seek_fd;               // Own descriptor for ioctl seeks, opened on first use
+    off_t read_off;
+    off_t read_end;            // -1 when the reply runs until EOF
+    bool pinned;               // Holds the -R window at pin_base
+    off_t pin_base;
+    bool read_eof;
+    size_t pending_send;       // Bytes read into buf but not yet sent
+    char *buf;
+    int buf_index;             // Registered buffer index, -1 if heap allocated
+    uint64_t append_start;     // stats_now() when the append was queued
+    uint64_t reply_start;      // stats_now() when the reply began
+    struct reply_sink sink;    // Collects binary replies into out
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    bool pushing;              // Send of push in flight (subscribers only)
+    struct broadcast_span push;
+    LIST_ENTRY(uring_conn) entries;
+    LIST_ENTRY(uring_conn) sub_entries;
+    STAILQ_ENTRY(uring_conn) append_entries;
+};
+
+LIST_HEAD(uring_conn_list, uring_conn);
+
+static struct uring ring = { .fd = -1 };
+static struct uring_conn_list conns = LIST_HEAD_INITIALIZER(conns);
+static struct uring_conn_list subscribers = LIST_HEAD_INITIALIZER(subscribers);
+static struct io_uring_buf_ring *recv_ring;
+static char *recv_bufs;
+static char *reply_bufs;
+static struct buf_arena uring_arena;  // Message copies and reply overflow, see arena.c
+static int reply_free[REPLY_BUF_COUNT];
+static int reply_free_count;
+static int data_fd = -1;       // Long lived descriptor for appends and reads
+static off_t history_len;      // Bytes the data file has committed (file backend)
+static STAILQ_HEAD(, uring_conn) append_queue = STAILQ_HEAD_INITIALIZER(append_queue);
+static bool append_busy;       // A write to the data file is in flight
+static size_t append_written;  // Bytes of that append already written
+static struct __kernel_timespec timer_ts;  // config.timestamp_interval
+static char timestamp_buf[128];
+static size_t timestamp_len;
+static bool timestamp_inflight;  // Queued or being written
+static bool timestamp_queued;    // Waiting for the write in flight
+static unsigned long stat_messages;
+static unsigned long stat_enters;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int uring_init(struct uring *r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = RING_ENTRIES * 8;
+    r->fd = sys_io_uring_setup(RING_ENTRIES, &p);
+    if (r->fd == -1 && errno == EINVAL) {
+        // Older kernel, retry without the optional setup flags
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = RING_ENTRIES * 8;
+        r->fd = sys_io_uring_setup(RING_ENTRIES, &p);
+    }
+    if (r->fd == -1) {
+        syslog(LOG_ERR, "io_uring_setup failed: %s", strerror(errno));
+        return -1;
+    }
+
+    r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_size > r->sq_size) r->sq_size = r->cq_size;
+        r->cq_size = r->sq_size;
+    }
+    r->sq_ptr = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        syslog(LOG_ERR, "io_uring SQ mmap failed: %s", strerror(errno));
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            syslog(LOG_ERR, "io_uring CQ mmap failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        syslog(LOG_ERR, "io_uring SQE mmap failed: %s", strerror(errno));
+        return -1;
+    }
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sqe_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static void uring_exit(struct uring *r) {
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_size);
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr) munmap(r->cq_ptr, r->cq_size);
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED) munmap(r->sq_ptr, r->sq_size);
+    if (r->fd != -1) close(r->fd);
+    r->fd = -1;
+}
+
+// Publish queued SQEs and optionally wait for completions
+static int uring_submit(struct uring *r, unsigned wait_nr) {
+    unsigned to_submit = r->sqe_tail - *r->sq_tail;
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    stat_enters++;
+    return sys_io_uring_enter(r->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+}
+
+// Make sure n SQEs can be queued without an intervening submit, so links stay intact
+static void uring_reserve(struct uring *r, unsigned n) {
+    while (r->sq_entries - (r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)) < n) {
+        if (uring_submit(r, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            syslog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            return;
+        }
+    }
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *r, uint8_t opcode, int fd,
+                                          void *owner, enum uring_op op) {
+    uring_reserve(r, 1);
+    unsigned idx = r->sqe_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    r->sq_array[idx] = idx;
+    r->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)(uintptr_t)owner | op;
+    return sqe;
+}
+
+static void recv_buf_return(unsigned short bid) {
+    unsigned short tail = recv_ring->tail;
+    struct io_uring_buf *b = &recv_ring->bufs[tail & (RECV_BUF_COUNT - 1)];
+    b->addr = (uint64_t)(uintptr_t)(recv_bufs + (size_t)bid * RECV_BUF_SIZE);
+    b->len = RECV_BUF_SIZE;
+    b->bid = bid;
+    __atomic_store_n(&recv_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int setup_buffers(void) {
+    // Provided buffer ring for multishot recv
+    if (posix_memalign((void **)&recv_ring, 4096, RECV_BUF_COUNT * sizeof(struct io_uring_buf)) != 0 ||
+        !(recv_bufs = malloc((size_t)RECV_BUF_COUNT * RECV_BUF_SIZE))) {
+        syslog(LOG_ERR, "Failed to allocate recv buffers");
+        return -1;
+    }
+    memset(recv_ring, 0, RECV_BUF_COUNT * sizeof(struct io_uring_buf));
+    struct io_uring_buf_reg reg = {
+        .ring_addr = (uint64_t)(uintptr_t)recv_ring,
+        .ring_entries = RECV_BUF_COUNT,
+        .bgid = RECV_BUF_GROUP,
+    };
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        syslog(LOG_ERR, "Failed to register recv buffer ring: %s", strerror(errno));
+        return -1;
+    }
+    for (unsigned short bid = 0; bid < RECV_BUF_COUNT; bid++) {
+        recv_buf_return(bid);
+    }
+
+    // Registered buffers for reading the history back out of DATA_FILE
+    reply_bufs = malloc((size_t)REPLY_BUF_COUNT * REPLY_CHUNK);
+    if (!reply_bufs) {
+        syslog(LOG_ERR, "Failed to allocate reply buffers");
+        return -1;
+    }
+    struct iovec iov[REPLY_BUF_COUNT];
+    for (int i = 0; i < REPLY_BUF_COUNT; i++) {
+        iov[i].iov_base = reply_bufs + (size_t)i * REPLY_CHUNK;
+        iov[i].iov_len = REPLY_CHUNK;
+        reply_free[i] = i;
+    }
+    if (sys_io_uring_register(ring.fd, IORING_REGISTER_BUFFERS, iov, REPLY_BUF_COUNT) == -1) {
+        syslog(LOG_WARNING, "Failed to register reply buffers, using plain reads: %s", strerror(errno));
+        reply_free_count = 0;
+    } else {
+        reply_free_count = REPLY_BUF_COUNT;
+    }
+    return 0;
+}
+
+static void arm_accept(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring, IORING_OP_ACCEPT, sockfd, NULL, OP_ACCEPT);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void arm_recv(struct uring_conn *conn) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring, IORING_OP_RECV, conn->fd, conn, OP_RECV);
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_BUF_GROUP;
+    conn->recv_armed = true;
+}
+
+static void arm_timer(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring, IORING_OP_TIMEOUT, -1, NULL, OP_TIMER);
+    sqe->addr = (uint64_t)(uintptr_t)&timer_ts;
+    sqe->len = 1;
+}
+
+static void arm_wake(void) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring, IORING_OP_POLL_ADD, wake_fd, NULL, OP_WAKE);
+    sqe->poll32_events = POLLIN;
+}
+
+// Tear the connection down once nothing in the ring still refers to it
+static void conn_release(struct uring_conn *conn) {
+    if (!conn->closing) {
+        conn->closing = true;
+        if (conn->recv_armed) {
+            struct io_uring_sqe *sqe = uring_get_sqe(&ring, IORING_OP_ASYNC_CANCEL, conn->fd, NULL, OP_NONE);
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+        }
+    }
+    if (conn->recv_armed || conn->replying || conn->pushing) {
+        return;
+    }
+    if (conn->sink.subscribed) {
+        LIST_REMOVE(conn, sub_entries);
+    }
+    struct uring_line *line;
+    while ((line = STAILQ_FIRST(&conn->lines)) != NULL) {
+        STAILQ_REMOVE_HEAD(&conn->lines, entries);
+        arena_free(&uring_arena, line);
+    }
+    arena_free(&uring_arena, conn->held);
+    framer_free(&conn->framer);
+    reply_sink_release(&conn->sink);
+    free(conn->out);
+    if (conn->seek_fd != -1) close(conn->seek_fd);
+    LIST_REMOVE(conn, entries);
+    close(conn->fd);
+    free(conn);
+    stats_conn_close();
+}
+
+static void start_next_reply(struct uring_conn *conn);
+
+// Send a subscriber the next span of the broadcast ring, unless one is in flight
+static void push_subscriber(struct uring_conn *conn) {
+    if (conn->pushing || conn->closing) {
+        return;
+    }
+    int rc = broadcast_peek(&conn->sink.tail, &conn->push);
+    if (rc == -1) {
+        conn_release(conn);
+        return;
+    }
+    if (rc == 1) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&ring, IORING_OP_SEND, conn->fd, conn, OP_PUSH);
+        sqe->addr = (uint64_t)(uintptr_t)conn->push.data;
+        sqe->len = conn->push.len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        conn->pushing = true;
+    }
+}
+
+// Account for an append the data file has committed at the end of the
+// history; under -R the window may move past older segments
+static void note_append(size_t len) {
+    if (config.retention.segment_size) {
+        segment_append(history_len, len);
+        segment_retain();
+    }
+    history_len += len;
+}
+
+// Pin the retained window for a reply read from the data file; returns its start
+static off_t reply_pin(struct uring_conn *conn) {
+    conn->pin_base = segment_pin();
+    conn->pinned = true;
+    return conn->pin_base;
+}
+
+// Publish a completed append and start sending it to idle subscribers
+static void publish(const char *data, size_t len) {
+    broadcast_publish(data, len);
+    struct uring_conn *conn, *next;
+    LIST_FOREACH_SAFE(conn, &subscribers, sub_entries, next) {
+        push_subscriber(conn);
+    }
+}
+
+// Write (the rest of) the append at the head of the queue; conn is NULL for
+// the timestamp
+static void append_write(struct uring_conn *conn) {
+    const char *data = conn ? conn->cur->data : timestamp_buf;
+    size_t len = conn ? conn->cur->len : timestamp_len;
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring, IORING_OP_WRITE, data_fd, conn, OP_WRITE);
+    sqe->addr = (uint64_t)(uintptr_t)(data + append_written);
+    sqe->len = len - append_written;
+    sqe->off = (uint64_t)-1;
+    append_busy = true;
+}
+
+// Start the next queued append once the data file is free
+static void append_next(void) {
+    if (append_busy) {
+        return;
+    }
+    append_written = 0;
+    if (timestamp_queued) {
+        timestamp_queued = false;
+        append_write(NULL);
+        return;
+    }
+    struct uring_conn *conn = STAILQ_FIRST(&append_queue);
+    if (conn) {
+        STAILQ_REMOVE_HEAD(&append_queue, append_entries);
+        append_write(conn);
+    }
+}
+
+// Queue the connection's current message for appending; its reply waits on it
+static void append_queue_conn(struct uring_conn *conn) {
+    conn->append_start = stats_now();
+    conn->inflight++;
+    STAILQ_INSERT_TAIL(&append_queue, conn, append_entries);
+    append_next();
+}
+
+// A write to the data file completed. A short one is continued before any
+// other append; a failed one is cut back off, as fd_append() does. Returns
+// false while the append is still being written, else sets its status.
+static bool append_complete(struct uring_conn *conn, int res, int *status) {
+    const char *data = conn ? conn->cur->data : timestamp_buf;
+    size_t len = conn ? conn->cur->len : timestamp_len;
+    if (res == 0) {
+        res = -EIO;  // No progress, do not retry it forever
+    }
+    if (res > 0 && append_written + res < len) {
+        append_written += res;
+        append_write(conn);
+        return false;
+    }
+    append_busy = false;
+
+    *status = 0;
+    if (res < 0) {
+        aesd_log_ratelimited(LOG_ERR, "%s: %s", conn ? "Write failed" : "Failed to write timestamp",
+                             strerror(-res));
+        if (append_written > 0 && !config.storage->evicts && ftruncate(data_fd, history_len) == -1) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to trim a partly written line: %s", strerror(errno));
+        }
+        *status = -1;
+    } else {
+        note_append(len);
+        publish(data, len);
+    }
+    append_next();
+    return true;
+}
+
+static void on_push(struct uring_conn *conn, int res) {
+    conn->pushing = false;
+    if (res > 0) {
+        stats_add(STAT_BYTES_OUT, res);
+        broadcast_advance(&conn->sink.tail, &conn->push, res);
+    }
+    broadcast_release(&conn->push);
+    if (res < 0 && res != -ECANCELED) {
+        aesd_log_ratelimited(LOG_ERR, "Send failed: %s", strerror(-res));
+    }
+    if (res < 0 || conn->closing) {
+        conn_release(conn);
+    } else {
+        push_subscriber(conn);
+    }
+}
+
+static void conn_on_message(void *ctx, int op, const char *msg, size_t len);
+
+// Keep input for later, behind whatever is held already. Returns -1 if it
+// could not be held.
+static int conn_hold(struct uring_conn *conn, const char *buf, size_t len) {
+    size_t old = conn->held ? conn->held_len - conn->held_off : 0;
+    size_t cap;
+    char *held = arena_alloc(&uring_arena, old + len, &cap);
+    if (!held) {
+        aesd_log_ratelimited(LOG_ERR, "Failed to hold deferred input");
+        return -1;
+    }
+    if (old > 0) {
+        memcpy(held, conn->held + conn->held_off, old);
+    }
+    memcpy(held + old, buf, len);
+    arena_free(&uring_arena, conn->held);
+    conn->held = held;
+    conn->held_len = old + len;
+    conn->held_off = 0;
+    return 0;
+}
+
+// Frame input from buf, which is either the held input or a receive buffer
+// while nothing is held; a yield leaves the rest held. Returns -1 if the
+// input could not be held.
+static int conn_frame(struct uring_conn *conn, const char *buf, size_t len) {
+    size_t used = framer_feed(&conn->framer, buf, len, conn_on_message, conn);
+    if (conn->held) {
+        conn->held_off += used;
+        if (conn->held_off == conn->held_len) {
+            arena_free(&uring_arena, conn->held);
+            conn->held = NULL;
+            conn->held_len = conn->held_off = 0;
+        }
+        return 0;
+    }
+    return used < len ? conn_hold(conn, buf + used, len - used) : 0;
+}
+
+// Frame held input once the queue has room, and receive again when it is gone
+static void conn_resume(struct uring_conn *conn) {
+    if (conn->held && conn->queued < CONN_LINES_MAX && !conn->closing &&
+        conn_frame(conn, conn->held + conn->held_off, conn->held_len - conn->held_off) == -1) {
+        conn->closing = true;
+    }
+    if (!conn->held && !conn->recv_armed && !conn->eof && !conn->closing) {
+        arm_recv(conn);
+    }
+}
+
+static void finish_reply(struct uring_conn *conn) {
+    if (conn->buf_index >= 0) {
+        reply_free[reply_free_count++] = conn->buf_index;
+    } else {
+        arena_free(&uring_arena, conn->buf);
+    }
+    conn->buf = NULL;
+    if (!conn->reply_failed) {
+        stats_record(STAT_SEND, conn->reply_start);
+    }
+    arena_free(&uring_arena, conn->cur);
+    conn->cur = NULL;
+    conn->replying = false;
+    if (conn->pinned) {
+        segment_unpin(conn->pin_base);
+        conn->pinned = false;
+    }
+
+    conn_resume(conn);
+    if (conn->closing || (conn->eof && STAILQ_EMPTY(&conn->lines) && !conn->held)) {
+        conn_release(conn);
+    } else {
+        start_next_reply(conn);
+    }
+}
+
+static struct io_uring_sqe *queue_read(struct uring_conn *conn, size_t len, off_t off) {
+    struct io_uring_sqe *sqe;
+    if (conn->buf_index >= 0) {
+        sqe = uring_get_sqe(&ring, IORING_OP_READ_FIXED, conn->reply_fd, conn, OP_READ);
+        sqe->buf_index = conn->buf_index;
+    } else {
+        sqe = uring_get_sqe(&ring, IORING_OP_READ, conn->reply_fd, conn, OP_READ);
+    }
+    sqe->addr = (uint64_t)(uintptr_t)conn->buf;
+    sqe->len = len;
+    sqe->off = off;
+    conn->inflight++;
+    return sqe;
+}
+
+static struct io_uring_sqe *queue_send(struct uring_conn *conn, size_t len) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&ring, IORING_OP_SEND, conn->fd, conn, OP_SEND);
+    sqe->addr = (uint64_t)(uintptr_t)conn->buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    conn->inflight++;
+    return sqe;
+}
+
+// Queue the next linked stage of the reply: send what the last read returned,
+// then read the next chunk into the same buffer. Finishes the reply when
+// nothing is left.
+static void reply_stage(struct uring_conn *conn) {
+    struct io_uring_sqe *prev = NULL, *sqe;
+    uring_reserve(&ring, CHAIN_MAX);
+
+    if (conn->pending_send > 0) {
+        prev = queue_send(conn, conn->pending_send);
+        conn->pending_send = 0;
+    }
+
+    // A known length stops at the committed end, otherwise read until EOF
+    if (!conn->read_eof && (conn->read_end < 0 || conn->read_off < conn->read_end)) {
+        size_t len = REPLY_CHUNK;
+        if (conn->read_end >= 0 && (off_t)len > conn->read_end - conn->read_off) {
+            len = conn->read_end - conn->read_off;
+        }
+        sqe = queue_read(conn, len, conn->read_off);
+        if (prev) prev->flags |= IOSQE_IO_LINK;
+        prev = sqe;
+    }
+
+    if (!prev) {
+        finish_reply(conn);
+    }
+}
+
+// reply_fn collecting a binary reply in conn->out before it is sent
+static int conn_collect_reply(void *ctx, const char *buf, size_t len) {
+    struct uring_conn *conn = ctx;
+    if (conn->out_len + len > conn->out_cap) {
+        size_t new_cap = conn->out_cap ? conn->out_cap : BUF_SIZE;
+        while (new_cap < conn->out_len + len) {
+            new_cap *= 2;
+        }
+        char *new_buf = realloc(conn->out, new_cap);
+        if (!new_buf) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to grow reply buffer");
+            return -1;
+        }
+        conn->out = new_buf;
+        conn->out_cap = new_cap;
+    }
+    memcpy(conn->out + conn->out_len, buf, len);
+    conn->out_len += len;
+    return 0;
+}
+
+// Send what the sink collected in conn->out
+static void reply_from_out(struct uring_conn *conn) {
+    if (conn->out_len <= REPLY_CHUNK) {
+        memcpy(conn->buf, conn->out, conn->out_len);
+    } else {
+        // Too big for the reply buffer: hand the heap copy over instead
+        if (conn->buf_index >= 0) {
+            reply_free[reply_free_count++] = conn->buf_index;
+        } else {
+            arena_free(&uring_arena, conn->buf);
+        }
+        conn->buf = conn->out;
+        conn->buf_index = -1;
+        conn->out = NULL;
+        conn->out_cap = 0;
+    }
+    conn->pending_send = conn->out_len;
+}
+
+static void start_frame_reply(struct uring_conn *conn, struct uring_line *line) {
+    conn->read_off = conn->read_end = 0;
+
+    if (line->op == AESD_OP_APPEND && line->len > 0) {
+        // As for a line, the ack waits for the write; see append_settled()
+        append_queue_conn(conn);
+        return;
+    }
+
+    conn->out_len = 0;
+    process_frame(line->op, line->data, line->len, &conn->sink);
+    reply_from_out(conn);
+    reply_stage(conn);
+}
+
+static void start_next_reply(struct uring_conn *conn) {
+    struct uring_line *line = STAILQ_FIRST(&conn->lines);
+    if (!line || conn->replying || conn->closing) {
+        return;
+    }
+    STAILQ_REMOVE_HEAD(&conn->lines, entries);
+    conn->queued--;
+    conn->cur = line;
+    conn->replying = true;
+    conn->reply_failed = false;
+    conn->read_eof = false;
+    conn->pending_send = 0;
+    conn->reply_start = stats_now();
+    if (reply_free_count > 0) {
+        conn->buf_index = reply_free[--reply_free_count];
+        conn->buf = reply_bufs + (size_t)conn->buf_index * REPLY_CHUNK;
+    } else {
+        // Unregistered, so its reads go through the plain opcode
+        size_t cap;
+        conn->buf_index = -1;
+        conn->buf = arena_alloc(&uring_arena, REPLY_CHUNK, &cap);
+        if (!conn->buf) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to allocate reply buffer");
+            finish_reply(conn);
+            return;
+        }
+    }
+
+    if (line->op != AESD_OP_LINE) {
+        start_frame_reply(conn, line);
+        return;
+    }
+
+    // Reserved stats command: send the report straight from the reply buffer
+    if (line->len == strlen(STATS_CMD) && memcmp(line->data, STATS_CMD, line->len) == 0) {
+        size_t size = REPLY_CHUNK < STATS_REPORT_SIZE ? REPLY_CHUNK : STATS_REPORT_SIZE;
+        conn->pending_send = stats_report(conn->buf, size);
+        conn->read_off = conn->read_end = 0;
+        reply_stage(conn);
+        return;
+    }
+
+    // Push-only from here on; whatever else the client queued is dropped
+    if (line->len == strlen(SUBSCRIBE_CMD) && memcmp(line->data, SUBSCRIBE_CMD, line->len) == 0) {
+        struct uring_line *queued;
+        while ((queued = STAILQ_FIRST(&conn->lines)) != NULL) {
+            STAILQ_REMOVE_HEAD(&conn->lines, entries);
+            arena_free(&uring_arena, queued);
+        }
+        conn->queued = 0;
+        broadcast_subscribe(&conn->sink.tail);
+        conn->sink.subscribed = true;
+        LIST_INSERT_HEAD(&subscribers, conn, sub_entries);
+        finish_reply(conn);
+        return;
+    }
+
+    // Session commands: both resend the whole history
+    bool delta_cmd = line->len == strlen(DELTA_CMD) && memcmp(line->data, DELTA_CMD, line->len) == 0;
+    if (delta_cmd || (line->len == strlen(FULL_CMD) && memcmp(line->data, FULL_CMD, line->len) == 0)) {
+        conn->sink.delta |= delta_cmd;
+        conn->sink.cursor = history_len;
+        conn->reply_fd = data_fd;
+        conn->read_off = reply_pin(conn);
+        conn->read_end = config.storage->evicts ? -1 : history_len;
+        reply_stage(conn);
+        return;
+    }
+
+    // Check for IOCTL command; the seek itself has no io_uring equivalent
+    if (strncmp(line->data, IOCTL_CMD_PREFIX, strlen(IOCTL_CMD_PREFIX)) == 0) {
+        unsigned int x, y;
+        if (sscanf(line->data + strlen(IOCTL_CMD_PREFIX), "%u,%u", &x, &y) != 2) {
+            aesd_log_ratelimited(LOG_ERR, "Malformed AESDCHAR_IOCSEEKTO command");
+            finish_reply(conn);
+            return;
+        }
+        struct aesd_seekto seekto = { .write_cmd = x, .write_cmd_offset = y };
+        // The seek moves the file position, so it cannot share data_fd
+        if (conn->seek_fd == -1) {
+            conn->seek_fd = open(config.storage->path, O_RDWR | O_CLOEXEC);
+        }
+        if (conn->seek_fd < 0) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to open data file for ioctl: %s", strerror(errno));
+            finish_reply(conn);
+            return;
+        }
+        int fd = conn->seek_fd;
+        conn->reply_fd = fd;
+        uint64_t seek_start = stats_now();
+        int seek_rc = ioctl(fd, AESDCHAR_IOCSEEKTO, &seekto);
+        stats_record(STAT_SEEK, seek_start);
+        if (seek_rc == -1) {
+            aesd_log_ratelimited(LOG_ERR, "ioctl failed: %s", strerror(errno));
+            finish_reply(conn);
+            return;
+        }
+        conn->read_off = lseek(fd, 0, SEEK_CUR);
+        conn->read_end = -1;
+        reply_stage(conn);
+        return;
+    }
+
+    // Append; the history is read back once the write has completed
+    conn->read_off = conn->read_end = 0;
+    append_queue_conn(conn);
+}
+
+// Set up the reply to an append that has been written, or has failed. The
+// data file was written up to history_len and nothing else is being written
+// to it, so the reply ends there. Like append_reply(), a failed line gets no
+// reply and a failed frame an error.
+static void append_settled(struct uring_conn *conn, int status) {
+    if (status == 0) {
+        stats_record(STAT_APPEND, conn->append_start);
+    }
+    if (conn->cur->op != AESD_OP_LINE) {
+        conn->out_len = 0;
+        append_reply(conn->cur->op, status, history_len, &conn->sink);
+        reply_from_out(conn);
+        return;
+    }
+    if (status != 0) {
+        return;
+    }
+    conn->reply_fd = data_fd;
+    conn->read_off = reply_pin(conn);
+    if (!config.storage->evicts && conn->sink.delta && conn->sink.cursor <= history_len &&
+        conn->sink.cursor > conn->read_off) {
+        conn->read_off = conn->sink.cursor;
+    }
+    conn->sink.cursor = history_len;
+    conn->read_end = config.storage->evicts ? -1 : history_len;
+}
+
+// message_fn: queue the message until the connection's previous reply completes
+static void conn_on_message(void *ctx, int op, const char *msg, size_t len) {
+    struct uring_conn *conn = ctx;
+    if (conn->sink.subscribed) {
+        return;  // Push-only once subscribed
+    }
+    size_t cap;
+    struct uring_line *line = arena_alloc(&uring_arena, sizeof(*line) + len + 1, &cap);
+    if (!line) {
+        aesd_log_ratelimited(LOG_ERR, "Failed to allocate message");
+        return;
+    }
+    memcpy(line->data, msg, len);
+    line->data[len] = '\0';
+    line->op = op;
+    line->len = len;
+    STAILQ_INSERT_TAIL(&conn->lines, line, entries);
+    // Hold the rest of the input until the replies catch up
+    if (++conn->queued >= CONN_LINES_MAX) {
+        conn->framer.yield = true;
+    }
+    if (op != AESD_OP_HELLO && op != AESD_OP_ERROR) {
+        stat_messages++;
+        stats_add(STAT_MESSAGES, 1);
+    }
+}
+
+static void on_accept(struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !stop_flag) {
+        arm_accept();
+    }
+    if (cqe->res < 0) {
+        if (cqe->res != -ECANCELED) {
+            aesd_log_ratelimited(LOG_ERR, "Failed to accept connection: %s", strerror(-cqe->res));
+        }
+        return;
+    }
+    // The multishot accept completed in the kernel, so its completion is the
+    // earliest this loop can time from
+    uint64_t accept_start = stats_now();
+    struct uring_conn *conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        aesd_log_ratelimited(LOG_ERR, "Failed to allocate connection");
+        close(cqe->res);
+        return;
+    }
+    conn->fd = cqe->res;
+    framer_init(&conn->framer, config.max_line_len, &uring_arena);
+    conn->buf_index = -1;
+    conn->seek_fd = -1;
+    conn->sink = (struct reply_sink) {
+        .write = conn_collect_reply,
+        .ctx = conn,
+        .sock_fd = -1,
+        .data_fd = -1,
+        .arena = &uring_arena,
+        .snapshot = NULL,
+        .snapshot_cap = 0,
+    };
+    STAILQ_INIT(&conn->lines);
+    LIST_INSERT_HEAD(&conns, conn, entries);
+    arm_recv(conn);
+    stats_conn_open();
+    stats_record(STAT_ACCEPT, accept_start);
+}
+
+static void on_recv(struct uring_conn *conn, struct io_uring_cqe *cqe) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = false;
+    }
+
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        stats_add(STAT_BYTES_IN, cqe->res);
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        const char *buf = recv_bufs + (size_t)bid * RECV_BUF_SIZE;
+        bool was_held = conn->held != NULL;
+        if (!conn->closing) {
+            // Nothing new is framed ahead of what an earlier yield held
+            int rc = was_held ? conn_hold(conn, buf, cqe->res) : conn_frame(conn, buf, cqe->res);
+            if (rc == -1) {
+                conn->closing = true;
+            }
+        }
+        recv_buf_return(bid);
+        if (!was_held && conn->held && conn->recv_armed && !conn->closing) {
+            // Stop receiving; conn_resume() re-arms once the held input is framed
+            struct io_uring_sqe *sqe = uring_get_sqe(&ring, IORING_OP_ASYNC_CANCEL, -1, NULL, OP_NONE);
+            sqe->addr = (uint64_t)(uintptr_t)conn | OP_RECV;
+        }
+        start_next_reply(conn);
+    } else if (cqe->res == 0) {
+        aesd_log(LOG_INFO, "Client disconnected");
+        conn->eof = true;
+    } else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        aesd_log_ratelimited(LOG_ERR, "recv() failed: %s", strerror(-cqe->res));
+        conn->eof = true;
+    }
+
+    if (conn->closing || (conn->eof && !conn->replying && STAILQ_EMPTY(&conn->lines) && !conn->held)) {
+        conn_release(conn);
+    } else if (!conn->recv_armed && !conn->eof && !conn->held) {
+        arm_recv(conn);  // Multishot ended (e.g. ran out of buffers), re-arm
+    }
+}
+
+static void on_reply_cqe(struct uring_conn *conn, enum uring_op op, int res) {
+    switch (op) {
+    case OP_WRITE:
+        append_settled(conn, res);
+        break;
+    case OP_READ:
+        // The next send carries exactly what this read returned
+        if (res < 0) {
+            if (res != -ECANCELED) aesd_log_ratelimited(LOG_ERR, "Read failed: %s", strerror(-res));
+            conn->reply_failed = true;
+        } else if (res == 0) {
+            conn->read_eof = true;
+        } else {
+            conn->pending_send = res;
+            conn->read_off += res;
+        }
+        break;
+    case OP_SEND:
+        if (res > 0) {
+            stats_add(STAT_BYTES_OUT, res);
+        }
+        if (res < 0) {
+            conn->reply_failed = true;
+            if (res != -ECANCELED) {
+                aesd_log_ratelimited(LOG_ERR, "Send failed: %s", strerror(-res));
+                conn->closing = true;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (--conn->inflight == 0) {
+        if (conn->reply_failed || conn->closing) {
+            finish_reply(conn);
+        } else {
+            reply_stage(conn);
+        }
+    }
+}
+
+static void on_timer(void) {
+    if (stop_flag) {
+        return;
+    }
+    arm_timer();
+    if (!timestamp_inflight) {
+        timestamp_len = format_timestamp(timestamp_buf, sizeof(timestamp_buf));
+        if (timestamp_len == 0) {
+            return;
+        }
+        // Goes ahead of the queued appends, behind the one being written
+        timestamp_inflight = true;
+        timestamp_queued = true;
+        append_next();
+    }
+}
+
+static void handle_cqe(struct io_uring_cqe *cqe) {
+    enum uring_op op = cqe->user_data & OP_MASK;
+    struct uring_conn *conn = (struct uring_conn *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+
+    switch (op) {
+    case OP_ACCEPT:
+        on_accept(cqe);
+        break;
+    case OP_RECV:
+        on_recv(conn, cqe);
+        break;
+    case OP_WRITE: {
+        int status;
+        if (!append_complete(conn, cqe->res, &status)) {
+            break;  // The rest of a short write is on its way
+        }
+        if (conn) {
+            on_reply_cqe(conn, op, status);
+        } else {
+            timestamp_inflight = false;
+        }
+        break;
+    }
+    case OP_READ:
+    case OP_SEND:
+        on_reply_cqe(conn, op, cqe->res);
+        break;
+    case OP_TIMER:
+        on_timer();
+        break;
+    case OP_WAKE:
+        stop_flag = 1;
+        break;
+    case OP_PUSH:
+        on_push(conn, cqe->res);
+        break;
+    default:
+        break;
+    }
+}
+
+static void reap_completions(void) {
+    unsigned head = *ring.cq_head;
+    for (;;) {
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        if (head == tail) break;
+        while (head != tail) {
+            struct io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+            head++;
+            __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+            handle_cqe(&cqe);
+        }
+    }
+}
+
+int run_uring(void) {
+    int rc = -1;
+
+    if (config.storage->evicts) {
+        data_fd = open(config.storage->path, O_RDWR);
+    } else {
+        data_fd = open(config.storage->path, O_RDWR | O_APPEND | O_CREAT, 0644);
+    }
+    if (data_fd == -1) {
+        syslog(LOG_ERR, "Failed to open data file: %s", strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    history_len = fstat(data_fd, &st) == 0 ? st.st_size : 0;
+
+    if (uring_init(&ring) == -1 || setup_buffers() == -1 ||
+        arena_init(&uring_arena, config.arena_buffers, config.arena_buf_size) == -1) {
+        goto out;
+    }
+
+    timer_ts.tv_sec = config.timestamp_interval.tv_sec;
+    timer_ts.tv_nsec = config.timestamp_interval.tv_nsec;
+    arm_accept();
+    arm_timer();
+    arm_wake();
+    syslog(LOG_INFO, "io_uring backend running");
+
+    rc = 0;
+    while (!stop_flag) {
+        if (uring_submit(&ring, 1) == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                reap_completions();
+                continue;
+            }
+            syslog(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            rc = -1;
+            break;
+        }
+        reap_completions();
+    }
+    syslog(LOG_INFO, "io_uring backend: %lu messages, %lu io_uring_enter calls",
+           stat_messages, stat_enters);
+
+out:
+    uring_exit(&ring);  // Cancels whatever is still in flight
+    while (!LIST_EMPTY(&conns)) {
+        struct uring_conn *conn = LIST_FIRST(&conns);
+        struct uring_line *line;
+        while ((line = STAILQ_FIRST(&conn->lines)) != NULL) {
+            STAILQ_REMOVE_HEAD(&conn->lines, entries);
+            arena_free(&uring_arena, line);
+        }
+        if (conn->buf_index < 0) arena_free(&uring_arena, conn->buf);
+        if (conn->seek_fd != -1) close(conn->seek_fd);
+        arena_free(&uring_arena, conn->held);
+        broadcast_release(&conn->push);
+        framer_free(&conn->framer);
+        reply_sink_release(&conn->sink);
+        arena_free(&uring_arena, conn->cur);
+        LIST_REMOVE(conn, entries);
+        close(conn->fd);
+        free(conn);
+    }
+    free(recv_ring);
+    free(recv_bufs);
+    free(reply_bufs);
+    arena_destroy(&uring_arena);
+    close(data_fd);
+    data_fd = -1;
+    return rc;
+}
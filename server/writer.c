@@ -0,0 +1,237 @@
+/***********************************************************************
+* @file  writer.c
+* @version 8
+* @brief  Group commit writer thread for history appends
+*
+* @author Iyona Lynn Noronha, iyonalynn.noronha@Colorado.edu
+*
+* @institution University of Colorado Boulder (UCB)
+* @course   ECEN 5713 - Advanced Embedded Software Development
+* @instructor Dan Walkes
+*
+* Revision history:
+*   0 Initial release.
+*   1 Publish each committed batch to the broadcast ring for subscribers
+*   2 -S mmap commits a batch with memcpy() into the mapped log
+*   3 Record each entry's segment and apply -R retention after every batch
+*   4 Commit through the -S backend's append; the length comes from its open
+*   5 writer_append_batch() queues a whole chain of lines with one CAS
+*   6 writer_submit() queues a line without blocking; on_done reports the commit
+*   7 Evicting backends count an entry's bytes once a '\n' ends it, as the driver shows them
+*   8 A failed append reports the committed prefix; only that prefix is counted
+*
+* Connection threads no longer open and write the data file themselves. Each
+* one pushes an append_req onto a lock-free stack with a single CAS and
+* sleeps on the request's semaphore. The writer takes the whole stack with
+* one exchange, restores arrival order, and hands every pending line to the
+* -S backend in one append call: a single writev() for the file and char
+* backends. It then wakes each producer with the history length just past
+* that producer's line.
+*
+* The writer is woken only when a push finds the stack empty, so a burst of
+* producers costs one wakeup and one system call. With -S mmap or memory it
+* costs no system call at all unless the log has to grow.
+*
+* The UDP ingest thread pushes a whole received batch as one chain, so its
+* lines always reach the backend together and in order.
+*
+* Event loops must not sleep on a semaphore, so they use writer_submit()
+* instead. The request carries an on_done callback, which the writer calls
+* in place of the sem_post() once the batch is committed. Many lines from
+* one loop can then wait in the same batch.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include "aesdsocket.h"
+
+static struct append_req *pending;  // Lock-free stack, newest first
+static sem_t writer_wake;
+static pthread_t writer_thread_id;
+static bool writer_running;
+static volatile bool writer_stopping;
+static off_t committed_end;  // History length after the last batch, under file_mutex
+static off_t held_back;      // Evicting backends: bytes of an entry without its '\n' yet
+
+static void process_batch(struct append_req *batch) {
+    stats_lock(&file_mutex);
+
+    // Sole appender, so each line's end is the old length plus what precedes
+    // it. Evicting backends count every byte ever appended instead, from when
+    // the driver makes it readable: once a write with a '\n' ends its entry.
+    // A failed append commits a prefix of the batch and leaves nothing of the
+    // rest, so the lengths, segments and mirror follow exactly that prefix.
+    off_t end = committed_end;
+    off_t held = held_back;
+    size_t committed = config.storage->append(batch);
+
+    bool retention = config.retention.segment_size != 0;
+    size_t i = 0;
+    for (struct append_req *req = batch; req; req = req->next, i++) {
+        req->status = i < committed ? 0 : -1;
+        if (req->status == -1) {
+            req->end = end;
+            continue;
+        }
+        if (retention) {
+            segment_append(end, req->len);
+        }
+        if (config.storage->evicts) {
+            held += req->len;
+            if (memchr(req->data, '\n', req->len)) {
+                end += held;
+                held = 0;
+            }
+        } else {
+            end += req->len;
+        }
+        req->end = end;
+        if (config.history_mirror) {
+            history_append(req->data, req->len);
+        }
+    }
+    committed_end = end;
+    held_back = held;
+    if (committed > 0 && retention) {
+        off_t base = segment_retain();
+        if (config.history_mirror) {
+            history_trim(end - base);
+        }
+    }
+    pthread_mutex_unlock(&file_mutex);
+
+    // Only the writer publishes, so subscribers see lines in commit order
+    if (committed > 0) {
+        broadcast_publish_batch(batch, committed);
+    }
+
+    while (batch) {
+        // The request lives on the producer's stack, or is reused by on_done;
+        // read next before handing it back
+        struct append_req *next = batch->next;
+        if (batch->on_done) {
+            batch->on_done(batch);
+        } else {
+            sem_post(&batch->done);
+        }
+        batch = next;
+    }
+}
+
+static void *writer_thread(void *arg) {
+    (void)arg;
+    for (;;) {
+        while (sem_wait(&writer_wake) == -1 && errno == EINTR) {
+        }
+
+        struct append_req *stack = __atomic_exchange_n(&pending, NULL, __ATOMIC_ACQUIRE);
+        if (!stack) {
+            if (writer_stopping) break;
+            continue;
+        }
+
+        // Reverse into arrival order
+        struct append_req *batch = NULL;
+        while (stack) {
+            struct append_req *next = stack->next;
+            stack->next = batch;
+            batch = stack;
+            stack = next;
+        }
+        process_batch(batch);
+    }
+    return NULL;
+}
+
+// Push first..last, already linked newest first, onto the stack with one CAS
+static void writer_push(struct append_req *first, struct append_req *last) {
+    struct append_req *head = __atomic_load_n(&pending, __ATOMIC_RELAXED);
+    do {
+        first->next = head;
+    } while (!__atomic_compare_exchange_n(&pending, &head, last, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    if (!head) {
+        sem_post(&writer_wake);  // Stack was empty, the writer may be asleep
+    }
+}
+
+int writer_append(const char *data, size_t len, off_t *end) {
+    struct append_req req = { .data = data, .len = len, .status = -1 };
+    sem_init(&req.done, 0, 0);
+    writer_push(&req, &req);
+
+    while (sem_wait(&req.done) == -1 && errno == EINTR) {
+    }
+    sem_destroy(&req.done);
+    if (end) {
+        *end = req.end;
+    }
+    return req.status;
+}
+
+void writer_submit(struct append_req *req) {
+    req->status = -1;
+    writer_push(req, req);
+}
+
+int writer_append_batch(struct append_req *reqs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        reqs[i].next = i > 0 ? &reqs[i - 1] : NULL;
+        reqs[i].status = -1;
+        reqs[i].on_done = NULL;
+        sem_init(&reqs[i].done, 0, 0);
+    }
+    writer_push(&reqs[0], &reqs[count - 1]);
+
+    // The chain is taken in one exchange and woken in order, so once the
+    // last request is done the writer is finished with all of them. Only a
+    // suffix of a batch can fail, so the last status covers the chain.
+    struct append_req *last = &reqs[count - 1];
+    while (sem_wait(&last->done) == -1 && errno == EINTR) {
+    }
+    for (size_t i = 0; i < count; i++) {
+        sem_destroy(&reqs[i].done);
+    }
+    return last->status;
+}
+
+off_t writer_history_end(void) {
+    return committed_end;
+}
+
+static void storage_close(void) {
+    if (config.storage->close) {
+        config.storage->close();
+    }
+}
+
+int writer_start(void) {
+    committed_end = config.storage->open();
+    if (committed_end == -1) {
+        return -1;
+    }
+    sem_init(&writer_wake, 0, 0);
+    if (pthread_create(&writer_thread_id, NULL, writer_thread, NULL) != 0) {
+        syslog(LOG_ERR, "Failed to create writer thread");
+        sem_destroy(&writer_wake);
+        storage_close();
+        return -1;
+    }
+    writer_running = true;
+    return 0;
+}
+
+// Commit whatever is still queued and stop the writer; safe if never started
+void writer_stop(void) {
+    if (!writer_running) {
+        return;
+    }
+    writer_stopping = true;
+    sem_post(&writer_wake);
+    pthread_join(writer_thread_id, NULL);
+    sem_destroy(&writer_wake);
+    storage_close();
+    writer_running = false;
+}
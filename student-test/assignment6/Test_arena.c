@@ -0,0 +1,129 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../server/aesdsocket.h"
+
+/**
+* Checks the buffers under the -A worker arenas: once an arena is sized for
+* the traffic, the line framer and arena_alloc()/arena_free() perform no
+* malloc() or free() at all.
+*
+* malloc() and free() are interposed below and counted while counting is set.
+* Each request arrives in two pieces, so the framer carries the partial line
+* in an arena buffer, and a reply-sized buffer is then drawn from the arena
+* and returned. The server's own request handling (process_message(), the
+* reply_sink snapshot, the reactor's and pool's connection code) is not run
+* here, so this does not cover allocations made there.
+*/
+
+// glibc's allocator entry points, which the interposed versions forward to
+extern void *__libc_malloc(size_t size);
+extern void __libc_free(void *ptr);
+
+static bool counting;
+static unsigned long malloc_calls;
+static unsigned long free_calls;
+
+void *malloc(size_t size)
+{
+    if (counting) {
+        malloc_calls++;
+    }
+    return __libc_malloc(size);
+}
+
+void free(void *ptr)
+{
+    if (counting) {
+        free_calls++;
+    }
+    __libc_free(ptr);
+}
+
+#define ARENA_TEST_BUFFERS 4
+#define ARENA_TEST_BUF_SIZE 1024
+#define ARENA_TEST_ROUNDS 10000
+
+struct request_load {
+    struct buf_arena *arena;
+    size_t reply_len;
+    unsigned long replies;
+};
+
+// Draws and returns one reply-sized arena buffer per framed request
+static void reply_from_arena(void *ctx, int op, const char *msg, size_t len)
+{
+    struct request_load *load = ctx;
+    (void)op;
+    size_t cap;
+    char *reply = arena_alloc(load->arena, load->reply_len, &cap);
+    TEST_ASSERT_NOT_NULL(reply);
+    memset(reply, 'r', load->reply_len);
+    memcpy(reply, msg, len < load->reply_len ? len : load->reply_len);
+    arena_free(load->arena, reply);
+    load->replies++;
+}
+
+// Feed rounds requests through the framer, each split across two receives
+static void run_requests(struct line_framer *framer, struct request_load *load,
+                         const char *request, size_t len, unsigned long rounds)
+{
+    size_t half = len / 2;
+    for (unsigned long i = 0; i < rounds; i++) {
+        framer_feed(framer, request, half, reply_from_arena, load);
+        framer_feed(framer, request + half, len - half, reply_from_arena, load);
+    }
+}
+
+void test_framer_and_arena_buffers_do_not_allocate()
+{
+    struct buf_arena arena;
+    struct line_framer framer;
+    struct request_load load = { .arena = &arena, .reply_len = ARENA_TEST_BUF_SIZE };
+    const char request[] = "a request that arrives in two pieces\n";
+
+    TEST_ASSERT_EQUAL_INT(0, arena_init(&arena, ARENA_TEST_BUFFERS, ARENA_TEST_BUF_SIZE));
+    framer_init(&framer, MAX_LINE_DEFAULT, &arena);
+
+    // First calls may set up per-thread state such as the stats shard
+    run_requests(&framer, &load, request, strlen(request), 10);
+
+    malloc_calls = free_calls = 0;
+    counting = true;
+    run_requests(&framer, &load, request, strlen(request), ARENA_TEST_ROUNDS);
+    counting = false;
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(10 + ARENA_TEST_ROUNDS, load.replies,
+                                     "Every request should have been answered");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, malloc_calls, "Framing and arena buffers called malloc()");
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(0, free_calls, "Framing and arena buffers called free()");
+
+    framer_free(&framer);
+    arena_destroy(&arena);
+}
+
+void test_arena_oversized_reply_falls_back_to_heap()
+{
+    struct buf_arena arena;
+    struct line_framer framer;
+    // Larger than any arena buffer, so each reply is a counted miss
+    struct request_load load = { .arena = &arena, .reply_len = ARENA_TEST_BUF_SIZE * 4 };
+    const char request[] = "a request with a large reply\n";
+
+    TEST_ASSERT_EQUAL_INT(0, arena_init(&arena, ARENA_TEST_BUFFERS, ARENA_TEST_BUF_SIZE));
+    framer_init(&framer, MAX_LINE_DEFAULT, &arena);
+    run_requests(&framer, &load, request, strlen(request), 10);
+
+    malloc_calls = free_calls = 0;
+    counting = true;
+    run_requests(&framer, &load, request, strlen(request), 100);
+    counting = false;
+
+    // Shows the counting above is live: misses go through malloc() and free()
+    TEST_ASSERT_EQUAL_UINT32(100, malloc_calls);
+    TEST_ASSERT_EQUAL_UINT32(100, free_calls);
+
+    framer_free(&framer);
+    arena_destroy(&arena);
+}